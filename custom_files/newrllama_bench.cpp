@@ -0,0 +1,250 @@
+// Benchmark harness for the newrllama C-API.
+//
+// Sweeps prompt length, generation length, n_threads, n_seq_max and the number of
+// parallel prompts through newrllama_generate_stream and newrllama_generate_parallel_ext,
+// and prints one JSON object per configuration (JSON Lines) on stdout. Single-sequence
+// runs (time-to-first-token, per-token latency) use the n_seq_max = 1 contexts.
+//
+// Usage:
+//   newrllama-bench -m model.gguf [-p 128,512] [-n 64,128] [-t 4,8] [-s 1,4]
+//                   [-b 4,16] [-r 3] [-c 4096] [-ngl 0]
+//   -p prompt tokens, -n generated tokens, -t threads, -s n_seq_max,
+//   -b prompts per generate_parallel call, -r repetitions (medians are reported)
+#include "newrllama_capi.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+  #include <windows.h>
+  #include <psapi.h>
+#else
+  #include <sys/resource.h>
+#endif
+
+using bench_clock = std::chrono::steady_clock;
+
+struct bench_args {
+    std::string model_path;
+    std::vector<int> prompt_lengths = {128, 512};
+    std::vector<int> gen_lengths = {64};
+    std::vector<int> n_threads = {4};
+    std::vector<int> n_seq_max = {1, 4};
+    std::vector<int> n_prompts = {4, 16};
+    int repetitions = 3;
+    int n_ctx = 4096;
+    int n_gpu_layers = 0;
+};
+
+static std::vector<int> parse_int_list(const char* s) {
+    std::vector<int> out;
+    std::string item;
+    for (const char* p = s; ; ++p) {
+        if (*p == ',' || *p == '\0') {
+            if (!item.empty()) out.push_back(std::atoi(item.c_str()));
+            item.clear();
+            if (*p == '\0') break;
+        } else {
+            item += *p;
+        }
+    }
+    return out;
+}
+
+static bool parse_args(int argc, char** argv, bench_args& args) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string flag = argv[i];
+        if (i + 1 >= argc) return false;
+        const char* value = argv[++i];
+        if (flag == "-m") args.model_path = value;
+        else if (flag == "-p") args.prompt_lengths = parse_int_list(value);
+        else if (flag == "-n") args.gen_lengths = parse_int_list(value);
+        else if (flag == "-t") args.n_threads = parse_int_list(value);
+        else if (flag == "-s") args.n_seq_max = parse_int_list(value);
+        else if (flag == "-b") args.n_prompts = parse_int_list(value);
+        else if (flag == "-r") args.repetitions = std::atoi(value);
+        else if (flag == "-c") args.n_ctx = std::atoi(value);
+        else if (flag == "-ngl") args.n_gpu_layers = std::atoi(value);
+        else return false;
+    }
+    return !args.model_path.empty();
+}
+
+static double peak_rss_mb() {
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) return pmc.PeakWorkingSetSize / (1024.0 * 1024.0);
+    return -1.0;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) return -1.0;
+  #ifdef __APPLE__
+    return usage.ru_maxrss / (1024.0 * 1024.0);   // bytes
+  #else
+    return usage.ru_maxrss / 1024.0;              // kilobytes
+  #endif
+#endif
+}
+
+static double ms_since(bench_clock::time_point t0, bench_clock::time_point t1) {
+    return std::chrono::duration<double, std::milli>(t1 - t0).count();
+}
+
+static double percentile(std::vector<double> v, double q) {
+    if (v.empty()) return 0.0;
+    std::sort(v.begin(), v.end());
+    const size_t idx = std::min(v.size() - 1, (size_t)(q * (v.size() - 1) + 0.5));
+    return v[idx];
+}
+
+// Builds a prompt of exactly n_tokens tokens by repeating filler text.
+static std::vector<int32_t> make_prompt_tokens(newrllama_model_handle model, int n_tokens, int variant) {
+    std::string text = "Request " + std::to_string(variant) + ". ";
+    while ((int)text.size() < n_tokens * 8) {
+        text += "The quick brown fox jumps over the lazy dog while the committee reviews quarterly figures. ";
+    }
+    int32_t* tokens = nullptr;
+    size_t n = 0;
+    const char* err = nullptr;
+    if (newrllama_tokenize(model, text.c_str(), true, &tokens, &n, &err) != NEWRLLAMA_SUCCESS) return {};
+    std::vector<int32_t> out(tokens, tokens + std::min(n, (size_t)n_tokens));
+    newrllama_free_tokens(tokens);
+    return out;
+}
+
+struct stream_timing {
+    bench_clock::time_point t_start;
+    std::vector<bench_clock::time_point> t_tokens;
+};
+
+static bool record_token(const char*, size_t, int32_t token, void* user_data) {
+    if (token >= 0) static_cast<stream_timing*>(user_data)->t_tokens.push_back(bench_clock::now());
+    return true;
+}
+
+static void bench_single(newrllama_context_handle ctx, newrllama_model_handle model, const bench_args& args, int n_threads, int n_seq_max) {
+    for (int n_prompt : args.prompt_lengths) {
+        const std::vector<int32_t> prompt = make_prompt_tokens(model, n_prompt, 0);
+        for (int n_gen : args.gen_lengths) {
+            std::vector<double> ttft, prefill_tps, decode_tps, latencies;
+            int n_generated = 0;
+            for (int rep = 0; rep < args.repetitions; ++rep) {
+                newrllama_kv_cache_clear(ctx);
+                stream_timing timing;
+                timing.t_start = bench_clock::now();
+                char* result = nullptr;
+                const char* err = nullptr;
+                if (newrllama_generate_stream(ctx, prompt.data(), prompt.size(), n_gen, 1, 1.0f, 0.0f, 0, 1.0f, 42, record_token, &timing, &result, &err) != NEWRLLAMA_SUCCESS) {
+                    std::fprintf(stderr, "generate failed: %s\n", err ? err : "unknown error");
+                    return;
+                }
+                newrllama_free_string(result);
+                if (timing.t_tokens.empty()) continue;
+                const double t_first = ms_since(timing.t_start, timing.t_tokens.front());
+                const double t_decode = ms_since(timing.t_tokens.front(), timing.t_tokens.back());
+                ttft.push_back(t_first);
+                prefill_tps.push_back(prompt.size() * 1000.0 / t_first);
+                if (timing.t_tokens.size() > 1) decode_tps.push_back((timing.t_tokens.size() - 1) * 1000.0 / t_decode);
+                for (size_t i = 1; i < timing.t_tokens.size(); ++i) latencies.push_back(ms_since(timing.t_tokens[i - 1], timing.t_tokens[i]));
+                n_generated = (int)timing.t_tokens.size();
+            }
+            std::printf("{\"mode\":\"single\",\"n_threads\":%d,\"n_seq_max\":%d,\"n_prompts\":1,\"prompt_tokens\":%zu,"
+                        "\"gen_tokens\":%d,\"prefill_tps\":%.2f,\"decode_tps\":%.2f,\"ttft_ms\":%.3f,"
+                        "\"p50_token_ms\":%.3f,\"p99_token_ms\":%.3f,\"peak_rss_mb\":%.1f}\n",
+                        n_threads, n_seq_max, prompt.size(), n_generated,
+                        percentile(prefill_tps, 0.5), percentile(decode_tps, 0.5), percentile(ttft, 0.5),
+                        percentile(latencies, 0.5), percentile(latencies, 0.99), peak_rss_mb());
+            std::fflush(stdout);
+        }
+    }
+}
+
+static void bench_parallel(newrllama_context_handle ctx, newrllama_model_handle model, const bench_args& args, int n_threads, int n_seq_max) {
+    for (int n_prompts : args.n_prompts) {
+        for (int n_prompt : args.prompt_lengths) {
+            // Detokenize exact-length prompts so each request is distinct but the same size.
+            std::vector<std::string> texts;
+            for (int i = 0; i < n_prompts; ++i) {
+                const std::vector<int32_t> toks = make_prompt_tokens(model, n_prompt, i);
+                char* text = nullptr;
+                const char* err = nullptr;
+                // Skip the BOS token: generate_parallel adds it again when tokenizing.
+                const size_t skip = (!toks.empty() && toks[0] == newrllama_token_bos(model)) ? 1 : 0;
+                if (newrllama_detokenize(model, toks.data() + skip, toks.size() - skip, &text, &err) != NEWRLLAMA_SUCCESS) return;
+                texts.emplace_back(text);
+                newrllama_free_string(text);
+            }
+            std::vector<const char*> prompts;
+            for (const auto& t : texts) prompts.push_back(t.c_str());
+            for (int n_gen : args.gen_lengths) {
+                struct newrllama_sampling_params params = newrllama_sampling_default_params();
+                params.max_tokens = n_gen;
+                params.top_k = 1;
+                params.top_p = 1.0f;
+                params.temperature = 0.0f;
+                params.repeat_last_n = 0;
+                params.penalty_repeat = 1.0f;
+                params.seed = 42;
+                std::vector<double> total_tps, wall_ms, occupancy;
+                long long n_generated = 0;
+                for (int rep = 0; rep < args.repetitions; ++rep) {
+                    newrllama_kv_cache_clear(ctx);
+                    struct newrllama_perf_stats stats = {};
+                    char** results = nullptr;
+                    const char* err = nullptr;
+                    if (newrllama_generate_parallel_ext(ctx, prompts.data(), (int)prompts.size(), &params, 1, &results, &stats, &err) != NEWRLLAMA_SUCCESS) {
+                        std::fprintf(stderr, "generate_parallel failed: %s\n", err ? err : "unknown error");
+                        return;
+                    }
+                    newrllama_free_string_array(results, (int)prompts.size());
+                    total_tps.push_back(stats.tokens_per_second);
+                    wall_ms.push_back(stats.t_total_ms);
+                    occupancy.push_back(stats.avg_slot_occupancy);
+                    n_generated = stats.n_generated_tokens;
+                }
+                std::printf("{\"mode\":\"parallel\",\"n_threads\":%d,\"n_seq_max\":%d,\"n_prompts\":%d,\"prompt_tokens\":%d,"
+                            "\"gen_tokens\":%lld,\"total_tps\":%.2f,\"wall_ms\":%.3f,\"avg_slot_occupancy\":%.3f,\"peak_rss_mb\":%.1f}\n",
+                            n_threads, n_seq_max, n_prompts, n_prompt, n_generated,
+                            percentile(total_tps, 0.5), percentile(wall_ms, 0.5), percentile(occupancy, 0.5), peak_rss_mb());
+                std::fflush(stdout);
+            }
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    bench_args args;
+    if (!parse_args(argc, argv, args)) {
+        std::fprintf(stderr, "usage: %s -m model.gguf [-p 128,512] [-n 64] [-t 4,8] [-s 1,4] [-b 4,16] [-r 3] [-c 4096] [-ngl 0]\n", argv[0]);
+        return 1;
+    }
+    const char* err = nullptr;
+    if (newrllama_backend_init(&err) != NEWRLLAMA_SUCCESS) {
+        std::fprintf(stderr, "backend init failed: %s\n", err ? err : "unknown error");
+        return 1;
+    }
+    newrllama_model_handle model = nullptr;
+    if (newrllama_model_load(args.model_path.c_str(), args.n_gpu_layers, true, false, &model, &err) != NEWRLLAMA_SUCCESS) {
+        std::fprintf(stderr, "model load failed: %s\n", err ? err : "unknown error");
+        return 1;
+    }
+    for (int n_threads : args.n_threads) {
+        for (int n_seq_max : args.n_seq_max) {
+            newrllama_context_handle ctx = nullptr;
+            if (newrllama_context_create(model, args.n_ctx, n_threads, n_seq_max, &ctx, &err) != NEWRLLAMA_SUCCESS) {
+                std::fprintf(stderr, "context create failed: %s\n", err ? err : "unknown error");
+                continue;
+            }
+            if (n_seq_max == 1) bench_single(ctx, model, args, n_threads, n_seq_max);
+            bench_parallel(ctx, model, args, n_threads, n_seq_max);
+            newrllama_context_free(ctx);
+        }
+    }
+    newrllama_model_free(model);
+    newrllama_backend_free();
+    return 0;
+}
@@ -1,14 +1,39 @@
 #define NEWRLLAMA_BUILD_DLL
 #include "newrllama_capi.h"
+#include "newrllama_utils.h"
 #include "llama.h"
+#include "ggml-backend.h"
 #include "common/common.h"
 #include "common/sampling.h"
+#include "common/json-schema-to-grammar.h"
+#include <nlohmann/json.hpp>
 #include <string>
 #include <vector>
 #include <stdexcept>
+#include <cstddef>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <thread>
+#include <unordered_map>
+
+#ifdef _WIN32
+  #define NOMINMAX
+  #include <windows.h>
+#else
+  #include <dirent.h>
+  #include <dlfcn.h>
+#endif
 
 static thread_local std::string last_error_message;
 
@@ -21,10 +46,94 @@ void set_error(const char** error_message, const std::string& msg) {
 
 static char* string_to_c_str(const std::string& s) { 
     char* cstr = new char[s.length() + 1]; 
-    std::strcpy(cstr, s.c_str()); 
+    std::memcpy(cstr, s.c_str(), s.length() + 1); 
     return cstr; 
 }
 
+// Per-context bookkeeping kept next to the llama_context: the tokens currently resident in
+// each sequence's KV cache, so later calls only decode what follows the cached prefix.
+struct context_state { 
+    std::vector<std::vector<llama_token>> seq_tokens; 
+    bool embeddings = false;   // context was created in embedding mode
+    int lookup_n_draft = 0;    // prompt-lookup speculation: tokens drafted per step, 0 off
+    int lookup_ngram_max = 3;  // longest n-gram matched when looking up drafts
+    bool ctx_shift = false;    // discard old tokens instead of failing when a sequence is full
+    int n_keep = 0;            // tokens at the start of a sequence a shift keeps, < 0 the prompt
+    std::mutex run_mutex;      // held while a call decodes or touches the KV cache, so jobs queue
+    int n_jobs = 0;            // async jobs using the context, guarded by context_states_mutex
+    std::condition_variable jobs_done; 
+}; 
+
+static std::mutex context_states_mutex; 
+static std::unordered_map<const llama_context*, context_state> context_states; 
+
+static context_state& get_context_state(const llama_context* ctx) { 
+    std::lock_guard<std::mutex> lock(context_states_mutex); 
+    context_state& state = context_states[ctx]; 
+    if (state.seq_tokens.size() < llama_n_seq_max(ctx)) state.seq_tokens.resize(llama_n_seq_max(ctx)); 
+    return state; 
+} 
+
+static void drop_context_state(const llama_context* ctx) { 
+    std::lock_guard<std::mutex> lock(context_states_mutex); 
+    context_states.erase(ctx); 
+} 
+
+// Async jobs hold the contexts they run on until their work returns; newrllama_context_free
+// waits for the holds to go before freeing.
+static void context_hold(const llama_context* ctx) { 
+    std::lock_guard<std::mutex> lock(context_states_mutex); 
+    context_states[ctx].n_jobs++; 
+} 
+
+static void context_unhold(const llama_context* ctx) { 
+    std::lock_guard<std::mutex> lock(context_states_mutex); 
+    context_state& state = context_states[ctx]; 
+    if (--state.n_jobs == 0) state.jobs_done.notify_all(); 
+} 
+
+static double elapsed_ms(std::chrono::steady_clock::time_point t0) { 
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count(); 
+} 
+
+static size_t common_prefix_length(const std::vector<llama_token>& a, const llama_token* b, size_t n_b) { 
+    size_t n = 0; 
+    const size_t n_max = std::min(a.size(), n_b); 
+    while (n < n_max && a[n] == b[n]) n++; 
+    return n; 
+} 
+
+// Keeps the longest common prefix of `cached` (the tokens in `seq`'s KV cache) and `tokens`
+// and removes everything after it. With keep_last_out, at least one token is left to decode
+// so the caller gets fresh logits. Returns the number of reusable tokens.
+static size_t reuse_cached_prefix(llama_context* ctx, llama_seq_id seq, std::vector<llama_token>& cached, const llama_token* tokens, size_t n_tokens, bool keep_last_out = true) { 
+    size_t n_common = common_prefix_length(cached, tokens, n_tokens); 
+    if (keep_last_out && n_common == n_tokens && n_common > 0) n_common--; 
+    if (!llama_kv_self_seq_rm(ctx, seq, (llama_pos)n_common, -1)) { 
+        // Partial removal is not supported (e.g. recurrent models): start the sequence over.
+        llama_kv_self_seq_rm(ctx, seq, -1, -1); 
+        n_common = 0; 
+    } 
+    cached.resize(n_common); 
+    return n_common; 
+} 
+
+// Drops positions [n_keep, n_keep + n_discard) of `seq` and moves the later ones back over the
+// gap, in the KV cache and in `cached`, its token mirror. The moved entries keep their computed
+// keys and values (RoPE is re-applied for the new positions), so nothing is decoded again.
+static void context_shift(llama_context* ctx, llama_seq_id seq, std::vector<llama_token>& cached, size_t n_keep, size_t n_discard) { 
+    const size_t n_end = std::min(cached.size(), n_keep + n_discard); 
+    if (n_end <= n_keep) return; 
+    llama_kv_self_seq_rm(ctx, seq, (llama_pos)n_keep, (llama_pos)n_end); 
+    llama_kv_self_seq_add(ctx, seq, (llama_pos)n_end, -1, -(llama_pos)(n_end - n_keep)); 
+    cached.erase(cached.begin() + n_keep, cached.begin() + n_end); 
+} 
+
+// The cells one sequence may fill before a shift: the KV cache is shared by all n_seq_max.
+static size_t context_seq_size(const llama_context* ctx) { 
+    return llama_n_ctx(ctx) / std::max<uint32_t>(llama_n_seq_max(ctx), 1); 
+} 
+
 static std::vector<llama_token> helper_tokenize(const llama_model* model, const std::string& text, bool add_special) { 
     const struct llama_vocab* vocab = llama_model_get_vocab(model); 
     int max_tokens = text.size() + 2; 
@@ -37,9 +146,78 @@ static std::vector<llama_token> helper_tokenize(const llama_model* model, const
     return tokens; 
 }
 
+// Owns a llama_batch for the length of a call, so every exit path frees it.
+struct scoped_batch { 
+    llama_batch batch; 
+    explicit scoped_batch(int32_t n_tokens, int32_t n_seq_max = 1) : batch(llama_batch_init(n_tokens, 0, n_seq_max)) {} 
+    ~scoped_batch() { llama_batch_free(batch); } 
+    scoped_batch(const scoped_batch&) = delete; 
+    scoped_batch& operator=(const scoped_batch&) = delete; 
+}; 
+
+// Decodes a token run into `seq` in pieces of at most n_batch tokens, so prompts longer than
+// the context's batch size can be prefilled. Positions continue from `cached`, the record of
+// `seq`'s KV contents, and decoded tokens are appended to it. Logits are kept for the last token.
+// A set `cancel` flag stops before the next piece; `cached` then still matches the KV cache.
+static int32_t decode_chunked(llama_context* ctx, llama_batch& batch, llama_seq_id seq, std::vector<llama_token>& cached, const llama_token* tokens, size_t n_tokens, const std::atomic<bool>* cancel = nullptr) { 
+    const size_t n_batch = llama_n_batch(ctx); 
+    for (size_t i = 0; i < n_tokens; i += n_batch) { 
+        if (cancel && *cancel) break; 
+        const size_t n = std::min(n_batch, n_tokens - i); 
+        common_batch_clear(batch); 
+        for (size_t k = 0; k < n; ++k) { 
+            common_batch_add(batch, tokens[i + k], (llama_pos)(cached.size() + k), {seq}, i + k == n_tokens - 1); 
+        } 
+        int32_t rc = llama_decode(ctx, batch); 
+        if (rc != 0) return rc; 
+        cached.insert(cached.end(), tokens + i, tokens + i + n); 
+    } 
+    return 0; 
+} 
+
+// Decodes tokens[n_past, end) into `seq` without requesting logits, in n_batch-sized pieces.
+static void prefill_sequence(llama_context* ctx, llama_batch& batch, llama_seq_id seq, std::vector<llama_token>& cached, const std::vector<llama_token>& tokens, size_t n_past) { 
+    const size_t n_batch = llama_n_batch(ctx); 
+    while (n_past < tokens.size()) { 
+        common_batch_clear(batch); 
+        const size_t n_end = std::min(tokens.size(), n_past + n_batch); 
+        for (size_t k = n_past; k < n_end; ++k) common_batch_add(batch, tokens[k], (llama_pos)k, {seq}, false); 
+        if (llama_decode(ctx, batch) != 0) throw std::runtime_error("Failed to decode shared prompt prefix."); 
+        cached.insert(cached.end(), tokens.begin() + n_past, tokens.begin() + n_end); 
+        n_past = n_end; 
+    } 
+} 
+
+// Directory holding this library, where a CPU-variant build (NEWRLLAMA_CPU_VARIANTS) places its
+// ggml backend modules; empty if it cannot be determined.
+static std::string library_dir() { 
+    std::string path; 
+#ifdef _WIN32
+    HMODULE module = nullptr; 
+    char buf[MAX_PATH]; 
+    if (GetModuleHandleExA(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS | GET_MODULE_HANDLE_EX_FLAG_UNCHANGED_REFCOUNT, (LPCSTR)&library_dir, &module)) { 
+        const DWORD n = GetModuleFileNameA(module, buf, MAX_PATH); 
+        if (n > 0 && n < MAX_PATH) path.assign(buf, n); 
+    } 
+#else
+    Dl_info info; 
+    if (dladdr((void*)&library_dir, &info) && info.dli_fname) path = info.dli_fname; 
+#endif
+    const size_t slash = path.find_last_of("/\\"); 
+    return slash == std::string::npos ? std::string() : path.substr(0, slash); 
+} 
+
 NEWRLLAMA_API newrllama_error_code newrllama_backend_init(const char** error_message) { 
     try { 
-        ggml_backend_load_all(); 
+        // Backend modules are looked up next to this library rather than next to the host
+        // executable (R). ggml scores each ggml-cpu variant against the host CPU and loads the
+        // best; a build with built-in backends finds no modules and keeps those.
+        const std::string dir = library_dir(); 
+        if (dir.empty()) { 
+            ggml_backend_load_all(); 
+        } else { 
+            ggml_backend_load_all_from_path(dir.c_str()); 
+        } 
         llama_backend_init(); 
         return NEWRLLAMA_SUCCESS; 
     } catch (const std::exception& e) { 
@@ -48,73 +226,485 @@ NEWRLLAMA_API newrllama_error_code newrllama_backend_init(const char** error_mes
     } 
 }
 
+// Name of the ggml-cpu variant module loaded from `dir` ("haswell", "skylakex", ...), or
+// "builtin" when the CPU backend is compiled into the library.
+static std::string loaded_cpu_variant(const std::string& dir) { 
+#ifdef _WIN32
+    const std::string prefix = "ggml-cpu-", suffix = ".dll"; 
+    WIN32_FIND_DATAA entry; 
+    HANDLE find = FindFirstFileA((dir + "\\" + prefix + "*" + suffix).c_str(), &entry); 
+    if (find != INVALID_HANDLE_VALUE) { 
+        do { 
+            const std::string name = entry.cFileName; 
+            if (GetModuleHandleA((dir + "\\" + name).c_str())) { 
+                FindClose(find); 
+                return name.substr(prefix.size(), name.size() - prefix.size() - suffix.size()); 
+            } 
+        } while (FindNextFileA(find, &entry)); 
+        FindClose(find); 
+    } 
+#else
+  #ifdef __APPLE__
+    const std::string prefix = "libggml-cpu-", suffix = ".dylib"; 
+  #else
+    const std::string prefix = "libggml-cpu-", suffix = ".so"; 
+  #endif
+    if (DIR* d = dir.empty() ? nullptr : opendir(dir.c_str())) { 
+        std::string found; 
+        while (dirent* entry = readdir(d)) { 
+            const std::string name = entry->d_name; 
+            if (name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) != 0 || name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) continue; 
+            // RTLD_NOLOAD only returns a handle for a module that is already loaded.
+            if (void* handle = dlopen((dir + "/" + name).c_str(), RTLD_NOW | RTLD_NOLOAD)) { 
+                dlclose(handle); 
+                found = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size()); 
+                break; 
+            } 
+        } 
+        closedir(d); 
+        if (!found.empty()) return found; 
+    } 
+#endif
+    return "builtin"; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_cpu_info(char** variant_out, char** features_out, const char** error_message) { 
+    ggml_backend_reg_t reg = ggml_backend_reg_by_name("CPU"); 
+    if (!reg) { 
+        set_error(error_message, "No CPU backend is registered; call newrllama_backend_init first."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    std::string features; 
+    auto get_features = (ggml_backend_get_features_t)ggml_backend_reg_get_proc_address(reg, "ggml_backend_get_features"); 
+    if (get_features) { 
+        for (ggml_backend_feature* f = get_features(reg); f && f->name; ++f) { 
+            if (!f->value || std::strcmp(f->value, "0") == 0) continue; 
+            if (!features.empty()) features += ","; 
+            features += f->name; 
+            if (std::strcmp(f->value, "1") != 0) features += std::string("=") + f->value; 
+        } 
+    } 
+    *variant_out = string_to_c_str(loaded_cpu_variant(library_dir())); 
+    *features_out = string_to_c_str(features); 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
 NEWRLLAMA_API void newrllama_backend_free() { 
     llama_backend_free(); 
 }
 
+// Model registry: loads of the same file with the same parameters share one llama_model.
+// Every model_load handle and every context holds a reference. A model nobody references is
+// idle; it stays loaded for reuse within the cache policy and is freed when evicted.
+struct model_entry { 
+    std::string key; 
+    int refs = 0; 
+    std::chrono::steady_clock::time_point idle_since; 
+}; 
+
+static std::mutex model_registry_mutex; 
+static std::condition_variable model_loaded;      // a load finished, successfully or not
+static std::unordered_map<std::string, llama_model*> models_by_key;   // nullptr while loading
+static std::unordered_map<const llama_model*, model_entry> model_entries; 
+static int model_cache_max_idle = 0;              // idle models kept loaded; 0 frees on last release
+static double model_cache_idle_timeout_s = -1.0;  // < 0: idle models never expire by age
+
+static std::string canonical_model_path(const char* path) { 
+#ifdef _WIN32
+    char buf[_MAX_PATH]; 
+    if (_fullpath(buf, path, _MAX_PATH)) return buf; 
+#else
+    if (char* resolved = realpath(path, nullptr)) { 
+        std::string out(resolved); 
+        free(resolved); 
+        return out; 
+    } 
+#endif
+    return path; 
+} 
+
+static void model_unregister_locked(llama_model* model) { 
+    models_by_key.erase(model_entries[model].key); 
+    model_entries.erase(model); 
+    llama_model_free(model); 
+} 
+
+// Frees idle models past the timeout, then the longest-idle ones beyond max_idle.
+static void evict_idle_models_locked() { 
+    const auto now = std::chrono::steady_clock::now(); 
+    std::vector<std::pair<std::chrono::steady_clock::time_point, llama_model*>> idle; 
+    std::vector<llama_model*> evict; 
+    for (auto& kv : model_entries) { 
+        if (kv.second.refs > 0) continue; 
+        llama_model* model = const_cast<llama_model*>(kv.first); 
+        const double idle_s = std::chrono::duration<double>(now - kv.second.idle_since).count(); 
+        if (model_cache_idle_timeout_s >= 0.0 && idle_s >= model_cache_idle_timeout_s) { 
+            evict.push_back(model); 
+        } else { 
+            idle.emplace_back(kv.second.idle_since, model); 
+        } 
+    } 
+    std::sort(idle.begin(), idle.end()); 
+    for (size_t i = 0; i + model_cache_max_idle < idle.size(); ++i) evict.push_back(idle[i].second); 
+    for (llama_model* model : evict) model_unregister_locked(model); 
+} 
+
+static void model_retain(const llama_model* model) { 
+    std::lock_guard<std::mutex> lock(model_registry_mutex); 
+    auto it = model_entries.find(model); 
+    if (it != model_entries.end()) it->second.refs++; 
+} 
+
+static void model_release(llama_model* model) { 
+    std::lock_guard<std::mutex> lock(model_registry_mutex); 
+    auto it = model_entries.find(model); 
+    if (it == model_entries.end()) { 
+        llama_model_free(model); 
+        return; 
+    } 
+    if (--it->second.refs == 0) { 
+        it->second.idle_since = std::chrono::steady_clock::now(); 
+        evict_idle_models_locked(); 
+    } 
+} 
+
 NEWRLLAMA_API newrllama_error_code newrllama_model_load(const char* model_path, int n_gpu_layers, bool use_mmap, bool use_mlock, newrllama_model_handle* model_handle_out, const char** error_message) { 
+    const std::string key = canonical_model_path(model_path) + "\n" + std::to_string(n_gpu_layers) + (use_mmap ? ":mmap" : "") + (use_mlock ? ":mlock" : ""); 
+    std::unique_lock<std::mutex> lock(model_registry_mutex); 
+    // Concurrent loads of one file wait for the first instead of duplicating it; loads of other
+    // files and the rest of the registry stay available meanwhile.
+    for (;;) { 
+        auto it = models_by_key.find(key); 
+        if (it == models_by_key.end()) break; 
+        if (it->second) { 
+            model_entries[it->second].refs++; 
+            *model_handle_out = it->second; 
+            return NEWRLLAMA_SUCCESS; 
+        } 
+        model_loaded.wait(lock); 
+    } 
+    models_by_key[key] = nullptr; 
+    lock.unlock(); 
     llama_model_params model_params = llama_model_default_params(); 
     model_params.n_gpu_layers = n_gpu_layers; 
     model_params.use_mmap = use_mmap; 
     model_params.use_mlock = use_mlock; 
     llama_model* model = llama_model_load_from_file(model_path, model_params); 
+    lock.lock(); 
+    model_loaded.notify_all(); 
     if (model == nullptr) { 
+        models_by_key.erase(key); 
         set_error(error_message, std::string("Failed to load model from path: ") + model_path); 
         return NEWRLLAMA_ERROR; 
     } 
+    models_by_key[key] = model; 
+    model_entry& entry = model_entries[model]; 
+    entry.key = key; 
+    entry.refs = 1; 
     *model_handle_out = model; 
     return NEWRLLAMA_SUCCESS; 
 }
 
 NEWRLLAMA_API void newrllama_model_free(newrllama_model_handle model) { 
-    if (model) llama_model_free(model); 
+    if (model) model_release(model); 
 }
 
-NEWRLLAMA_API newrllama_error_code newrllama_context_create(newrllama_model_handle model, int n_ctx, int n_threads, int n_seq_max, newrllama_context_handle* context_handle_out, const char** error_message) { 
-    if (!model) { 
-        set_error(error_message, "Model handle is null."); 
+NEWRLLAMA_API void newrllama_model_cache_set_policy(int max_idle_models, double idle_timeout_seconds) { 
+    std::lock_guard<std::mutex> lock(model_registry_mutex); 
+    model_cache_max_idle = std::max(max_idle_models, 0); 
+    model_cache_idle_timeout_s = idle_timeout_seconds; 
+    evict_idle_models_locked(); 
+} 
+
+NEWRLLAMA_API void newrllama_model_cache_clear() { 
+    std::lock_guard<std::mutex> lock(model_registry_mutex); 
+    std::vector<llama_model*> idle; 
+    for (auto& kv : model_entries) if (kv.second.refs == 0) idle.push_back(const_cast<llama_model*>(kv.first)); 
+    for (llama_model* model : idle) model_unregister_locked(model); 
+} 
+
+NEWRLLAMA_API void newrllama_model_cache_info(int* n_models_out, int* n_idle_out) { 
+    std::lock_guard<std::mutex> lock(model_registry_mutex); 
+    evict_idle_models_locked(); 
+    int n_idle = 0; 
+    for (auto& kv : model_entries) if (kv.second.refs == 0) n_idle++; 
+    if (n_models_out) *n_models_out = (int)model_entries.size(); 
+    if (n_idle_out) *n_idle_out = n_idle; 
+} 
+
+NEWRLLAMA_API struct newrllama_context_params newrllama_context_default_params() { 
+    const llama_context_params defaults = llama_context_default_params(); 
+    newrllama_context_params params = {}; 
+    params.struct_size = sizeof(newrllama_context_params); 
+    params.n_ctx = (int)defaults.n_ctx; 
+    params.n_threads = defaults.n_threads; 
+    params.n_seq_max = (int)defaults.n_seq_max; 
+    params.embeddings = false; 
+    params.pooling_type = LLAMA_POOLING_TYPE_UNSPECIFIED; 
+    params.n_batch = (int)defaults.n_batch; 
+    params.n_ubatch = (int)defaults.n_ubatch; 
+    params.n_threads_batch = 0; 
+    params.flash_attn = defaults.flash_attn; 
+    params.type_k = defaults.type_k; 
+    params.type_v = defaults.type_v; 
+    params.offload_kqv = defaults.offload_kqv; 
+    params.rope_scaling_type = defaults.rope_scaling_type; 
+    params.rope_freq_base = defaults.rope_freq_base; 
+    params.rope_freq_scale = defaults.rope_freq_scale; 
+    params.yarn_orig_ctx = (int)defaults.yarn_orig_ctx; 
+    params.defrag_thold = defaults.defrag_thold; 
+    params.lookup_n_draft = 0; 
+    params.lookup_ngram_max = 3; 
+    params.ctx_shift = false; 
+    params.n_keep = 0; 
+    return params; 
+} 
+
+// Every header had the fields through defrag_thold.
+static bool context_params_size_ok(const newrllama_context_params* params) { 
+    return params->struct_size >= offsetof(newrllama_context_params, defrag_thold) + sizeof(float); 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_context_create_ext(newrllama_model_handle model, const struct newrllama_context_params* params_in, newrllama_context_handle* context_handle_out, const char** error_message) { 
+    if (!model || !params_in) { 
+        set_error(error_message, "Model handle or context params are null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (!context_params_size_ok(params_in)) { 
+        set_error(error_message, "params->struct_size is too small; start from newrllama_context_default_params()."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    // Fields beyond the caller's struct_size postdate its header and keep their defaults.
+    newrllama_context_params params = newrllama_context_default_params(); 
+    std::memcpy(&params, params_in, std::min(params_in->struct_size, sizeof(params))); 
+    if (params.n_seq_max < 1 || params.n_batch < 1 || params.n_ubatch < 1) { 
+        set_error(error_message, "n_seq_max, n_batch and n_ubatch must be positive."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (params.type_v != GGML_TYPE_F16 && params.type_v != GGML_TYPE_F32 && params.type_v != GGML_TYPE_BF16 && !params.flash_attn) { 
+        set_error(error_message, "A quantized V cache requires flash_attn."); 
         return NEWRLLAMA_ERROR; 
     } 
     llama_context_params ctx_params = llama_context_default_params(); 
-    ctx_params.n_ctx = n_ctx; 
-    ctx_params.n_threads = n_threads; 
-    ctx_params.n_seq_max = n_seq_max; 
+    ctx_params.n_ctx = params.n_ctx; 
+    ctx_params.n_threads = params.n_threads; 
+    ctx_params.n_threads_batch = params.n_threads_batch > 0 ? params.n_threads_batch : params.n_threads; 
+    ctx_params.n_seq_max = params.n_seq_max; 
+    ctx_params.n_batch = params.n_batch; 
+    ctx_params.n_ubatch = std::min(params.n_ubatch, params.n_batch); 
+    ctx_params.embeddings = params.embeddings; 
+    ctx_params.pooling_type = (enum llama_pooling_type)params.pooling_type; 
+    ctx_params.flash_attn = params.flash_attn; 
+    ctx_params.type_k = (enum ggml_type)params.type_k; 
+    ctx_params.type_v = (enum ggml_type)params.type_v; 
+    ctx_params.offload_kqv = params.offload_kqv; 
+    ctx_params.rope_scaling_type = (enum llama_rope_scaling_type)params.rope_scaling_type; 
+    ctx_params.rope_freq_base = params.rope_freq_base; 
+    ctx_params.rope_freq_scale = params.rope_freq_scale; 
+    ctx_params.yarn_orig_ctx = params.yarn_orig_ctx; 
+    ctx_params.defrag_thold = params.defrag_thold; 
+    ctx_params.no_perf = false;   // prefill/decode timings in newrllama_perf_stats come from llama_perf_context
     llama_context* ctx = llama_init_from_model(model, ctx_params); 
     if (ctx == nullptr) { 
         set_error(error_message, "Failed to create context from model."); 
         return NEWRLLAMA_ERROR; 
     } 
+    context_state& state = get_context_state(ctx); 
+    state.embeddings = params.embeddings; 
+    state.lookup_n_draft = std::max(params.lookup_n_draft, 0); 
+    state.lookup_ngram_max = std::max(params.lookup_ngram_max, 1); 
+    if (params.ctx_shift && !llama_kv_self_can_shift(ctx)) { 
+        drop_context_state(ctx); 
+        llama_free(ctx); 
+        set_error(error_message, "ctx_shift is not supported by this model's KV cache."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    state.ctx_shift = params.ctx_shift; 
+    state.n_keep = params.n_keep; 
+    model_retain(model);   // the context keeps its model loaded
     *context_handle_out = ctx; 
     return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_context_create(newrllama_model_handle model, int n_ctx, int n_threads, int n_seq_max, newrllama_context_handle* context_handle_out, const char** error_message) { 
+    newrllama_context_params params = newrllama_context_default_params(); 
+    params.n_ctx = n_ctx; 
+    params.n_threads = n_threads; 
+    params.n_seq_max = n_seq_max; 
+    return newrllama_context_create_ext(model, &params, context_handle_out, error_message); 
 }
 
 NEWRLLAMA_API void newrllama_context_free(newrllama_context_handle ctx) { 
-    if (ctx) llama_free(ctx); 
+    if (ctx) { 
+        { 
+            std::unique_lock<std::mutex> lock(context_states_mutex); 
+            context_state& state = context_states[ctx]; 
+            state.jobs_done.wait(lock, [&state]() { return state.n_jobs == 0; }); 
+        } 
+        // Let a synchronous call on another thread finish its step first.
+        { std::lock_guard<std::mutex> lock(get_context_state(ctx).run_mutex); } 
+        llama_model* model = const_cast<llama_model*>(llama_get_model(ctx)); 
+        drop_context_state(ctx); 
+        llama_free(ctx); 
+        model_release(model); 
+    } 
+} 
+
+NEWRLLAMA_API void newrllama_kv_cache_clear(newrllama_context_handle ctx) { 
+    if (!ctx) return; 
+    context_state& state = get_context_state(ctx); 
+    std::lock_guard<std::mutex> run_lock(state.run_mutex); 
+    llama_kv_self_clear(ctx); 
+    for (auto& cached : state.seq_tokens) cached.clear(); 
 }
 
 NEWRLLAMA_API newrllama_error_code newrllama_tokenize(newrllama_model_handle model, const char* text, bool add_special, int32_t** tokens_out, size_t* n_tokens_out, const char** error_message) { 
-    try { 
-        std::vector<llama_token> tokens_vec = helper_tokenize(model, std::string(text), add_special); 
-        *n_tokens_out = tokens_vec.size(); 
-        *tokens_out = new int32_t[*n_tokens_out]; 
-        std::copy(tokens_vec.begin(), tokens_vec.end(), *tokens_out); 
-        return NEWRLLAMA_SUCCESS; 
-    } catch (const std::exception& e) { 
-        set_error(error_message, e.what()); 
+    if (!model || !text) { 
+        set_error(error_message, "Model or text handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    // Tokenize straight into the returned buffer, sized for one token per byte plus the special
+    // tokens; reallocate once at the exact size if that is short.
+    size_t cap = std::strlen(text) + 2; 
+    int32_t* buf = new int32_t[cap]; 
+    size_t n_tokens = 0; 
+    newrllama_error_code code = newrllama_tokenize_into(model, text, add_special, buf, cap, &n_tokens, error_message); 
+    if (code == NEWRLLAMA_SUCCESS && n_tokens > cap) { 
+        delete[] buf; 
+        cap = n_tokens; 
+        buf = new int32_t[cap]; 
+        code = newrllama_tokenize_into(model, text, add_special, buf, cap, &n_tokens, error_message); 
+    } 
+    if (code != NEWRLLAMA_SUCCESS) { 
+        delete[] buf; 
+        return NEWRLLAMA_ERROR; 
+    } 
+    *tokens_out = buf; 
+    *n_tokens_out = n_tokens; 
+    return NEWRLLAMA_SUCCESS; 
+}
+
+NEWRLLAMA_API newrllama_error_code newrllama_tokenize_into(newrllama_model_handle model, const char* text, bool add_special, int32_t* buf, size_t buf_size, size_t* n_tokens_out, const char** error_message) { 
+    if (!model || !text || (!buf && buf_size > 0)) { 
+        set_error(error_message, "Model, text or buffer handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const size_t text_len = std::strlen(text); 
+    if (text_len > (size_t)INT32_MAX - 2) { 
+        set_error(error_message, "Text is too long to tokenize."); 
         return NEWRLLAMA_ERROR; 
     } 
+    const llama_vocab* vocab = llama_model_get_vocab(model); 
+    const int32_t cap = (int32_t)std::min<size_t>(buf_size, INT32_MAX); 
+    const int32_t n = llama_tokenize(vocab, text, (int32_t)text_len, buf, cap, add_special, false); 
+    if (n < 0 && -n <= cap) { 
+        set_error(error_message, "Tokenization failed."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    *n_tokens_out = (size_t)(n < 0 ? -n : n); 
+    return NEWRLLAMA_SUCCESS; 
 }
 
+// Appends the text of `tokens` to `out`. llama_detokenize reports the exact size it needs when
+// the guess is too small, so at most one retry is needed whatever the script of the text.
+static void detokenize_append(const llama_vocab* vocab, const llama_token* tokens, size_t n_tokens, std::string& out) { 
+    const size_t n_old = out.size(); 
+    out.resize(n_old + n_tokens * 4 + 16); 
+    int32_t n = llama_detokenize(vocab, tokens, (int32_t)n_tokens, &out[n_old], (int32_t)(out.size() - n_old), false, false); 
+    if (n < 0) { 
+        out.resize(n_old + (size_t)-n); 
+        n = llama_detokenize(vocab, tokens, (int32_t)n_tokens, &out[n_old], -n, false, false); 
+        if (n < 0) throw std::runtime_error("Detokenization failed."); 
+    } 
+    out.resize(n_old + n); 
+} 
+
+// Appends the text of one token to `out` without a temporary string per token.
+static void token_piece_append(const llama_vocab* vocab, llama_token token, std::string& out) { 
+    const size_t n_old = out.size(); 
+    out.resize(n_old + 16); 
+    int32_t n = llama_token_to_piece(vocab, token, &out[n_old], 16, 0, true); 
+    if (n < 0) { 
+        out.resize(n_old + (size_t)-n); 
+        n = llama_token_to_piece(vocab, token, &out[n_old], -n, 0, true); 
+    } 
+    out.resize(n_old + std::max(n, 0)); 
+} 
+
 NEWRLLAMA_API newrllama_error_code newrllama_detokenize(newrllama_model_handle model, const int32_t* tokens, size_t n_tokens, char** text_out, const char** error_message) { 
+    if (!model) { 
+        set_error(error_message, "Model handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
     const struct llama_vocab* vocab = llama_model_get_vocab(model); 
-    size_t max_len = n_tokens * 8 + 1; 
-    std::vector<char> buf(max_len); 
-    int n_chars = llama_detokenize(vocab, tokens, n_tokens, buf.data(), buf.size(), false, false); 
+    // Write straight into the returned buffer; reallocate once at the exact size if the guess is short.
+    int32_t cap = (int32_t)(n_tokens * 4 + 16); 
+    char* buf = new char[cap + 1]; 
+    int32_t n_chars = llama_detokenize(vocab, tokens, (int32_t)n_tokens, buf, cap, false, false); 
+    if (n_chars < 0) { 
+        delete[] buf; 
+        cap = -n_chars; 
+        buf = new char[cap + 1]; 
+        n_chars = llama_detokenize(vocab, tokens, (int32_t)n_tokens, buf, cap, false, false); 
+    } 
     if (n_chars < 0) { 
+        delete[] buf; 
+        set_error(error_message, "Detokenization failed."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    buf[n_chars] = '\0'; 
+    *text_out = buf; 
+    return NEWRLLAMA_SUCCESS; 
+}
+
+NEWRLLAMA_API newrllama_error_code newrllama_detokenize_into(newrllama_model_handle model, const int32_t* tokens, size_t n_tokens, char* buf, size_t buf_size, size_t* length_out, const char** error_message) { 
+    if (!model || (!buf && buf_size > 0)) { 
+        set_error(error_message, "Model or buffer handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const struct llama_vocab* vocab = llama_model_get_vocab(model); 
+    const int32_t cap = buf_size > 0 ? (int32_t)std::min<size_t>(buf_size - 1, INT32_MAX) : 0; 
+    const int32_t n_chars = llama_detokenize(vocab, tokens, (int32_t)n_tokens, buf, cap, false, false); 
+    if (n_chars < 0 && cap > 0 && -n_chars <= cap) { 
         set_error(error_message, "Detokenization failed."); 
         return NEWRLLAMA_ERROR; 
     } 
-    *text_out = string_to_c_str(std::string(buf.data(), n_chars)); 
+    *length_out = (size_t)(n_chars < 0 ? -n_chars : n_chars); 
+    if (n_chars >= 0 && buf_size > 0) buf[n_chars] = '\0'; 
+    return NEWRLLAMA_SUCCESS; 
+}
+
+NEWRLLAMA_API newrllama_error_code newrllama_detokenize_batch(newrllama_model_handle model, const int32_t* tokens, const int64_t* offsets, int n_seqs, char** text_out, int64_t** offsets_out, const char** error_message) { 
+    if (!model || (n_seqs > 0 && (!tokens || !offsets))) { 
+        set_error(error_message, "Model, tokens or offsets handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (n_seqs <= 0) { 
+        *text_out = string_to_c_str(""); 
+        *offsets_out = new int64_t[1](); 
+        return NEWRLLAMA_SUCCESS; 
+    } 
+    if (!offsets_valid(offsets, (size_t)n_seqs, std::numeric_limits<int64_t>::max())) { 
+        set_error(error_message, "Offsets must be non-negative and non-decreasing."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const struct llama_vocab* vocab = llama_model_get_vocab(model); 
+    int64_t* text_offsets = new int64_t[(size_t)n_seqs + 1]; 
+    std::string text; 
+    text.reserve((size_t)(offsets[n_seqs] - offsets[0]) * 4 + 16); 
+    text_offsets[0] = 0; 
+    try { 
+        for (int i = 0; i < n_seqs; ++i) { 
+            detokenize_append(vocab, tokens + offsets[i], (size_t)(offsets[i + 1] - offsets[i]), text); 
+            text_offsets[i + 1] = (int64_t)text.size(); 
+        } 
+    } catch (const std::exception& e) { 
+        delete[] text_offsets; 
+        set_error(error_message, e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    *text_out = string_to_c_str(text); 
+    *offsets_out = text_offsets; 
     return NEWRLLAMA_SUCCESS; 
 }
 
@@ -126,155 +716,2244 @@ NEWRLLAMA_API void newrllama_free_tokens(int32_t* tokens) {
     if(tokens) delete[] tokens; 
 }
 
+// Texts handed to a tokenize_batch worker at a time. Each chunk is tokenized into one flat
+// buffer, so allocations scale with the number of chunks rather than the number of texts.
+static const int tokenize_chunk_size = 256; 
+
+// Tokenizes `text` directly onto the end of `out`, growing it only by what is needed.
+// parse_special turns control-token text (as written by chat templates) into those tokens.
+static void tokenize_append(const llama_vocab* vocab, const char* text, bool add_special, std::vector<llama_token>& out, bool parse_special = false) { 
+    const int32_t text_len = (int32_t)std::strlen(text); 
+    const size_t n_old = out.size(); 
+    out.resize(n_old + text_len + 2); 
+    int32_t n = llama_tokenize(vocab, text, text_len, out.data() + n_old, text_len + 2, add_special, parse_special); 
+    if (n < 0) { 
+        out.resize(n_old - n); 
+        n = llama_tokenize(vocab, text, text_len, out.data() + n_old, -n, add_special, parse_special); 
+        if (n < 0) throw std::runtime_error("Tokenization failed in batch."); 
+    } 
+    out.resize(n_old + n); 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_tokenize_batch(newrllama_model_handle model, const char** texts, int n_texts, bool add_special, int n_threads, int32_t** tokens_out, int64_t** offsets_out, const char** error_message) { 
+    if (!model || (n_texts > 0 && !texts)) { 
+        set_error(error_message, "Model or texts handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    n_texts = std::max(n_texts, 0); 
+    const llama_vocab* vocab = llama_model_get_vocab(model); 
+    const int n_chunks = (n_texts + tokenize_chunk_size - 1) / tokenize_chunk_size; 
+    if (n_threads <= 0) n_threads = (int)std::max(1u, std::thread::hardware_concurrency()); 
+    n_threads = std::max(1, std::min(n_threads, n_chunks)); 
+    // Per chunk: the concatenated tokens of its texts and the token count of each text.
+    std::vector<std::vector<llama_token>> chunk_tokens(n_chunks); 
+    int64_t* offsets = new int64_t[(size_t)n_texts + 1]; 
+    std::atomic<int> next_chunk(0); 
+    std::atomic<bool> failed(false); 
+    std::string first_error; 
+    std::mutex error_mutex; 
+    auto worker = [&]() { 
+        for (int c = next_chunk++; c < n_chunks && !failed; c = next_chunk++) { 
+            const int begin = c * tokenize_chunk_size; 
+            const int end = std::min(n_texts, begin + tokenize_chunk_size); 
+            std::vector<llama_token>& out = chunk_tokens[c]; 
+            try { 
+                for (int i = begin; i < end; ++i) { 
+                    tokenize_append(vocab, texts[i] ? texts[i] : "", add_special, out); 
+                    offsets[i + 1] = (int64_t)out.size();   // chunk-relative until rebased below
+                } 
+            } catch (const std::exception& e) { 
+                std::lock_guard<std::mutex> lock(error_mutex); 
+                if (!failed.exchange(true)) first_error = e.what(); 
+            } 
+        } 
+    }; 
+    std::vector<std::thread> pool; 
+    for (int t = 1; t < n_threads; ++t) pool.emplace_back(worker); 
+    worker(); 
+    for (auto& th : pool) th.join(); 
+    if (failed) { 
+        delete[] offsets; 
+        set_error(error_message, first_error); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    // Rebase the chunk-relative offsets and gather the chunks into one CSR token buffer.
+    offsets[0] = 0; 
+    int64_t n_total = 0; 
+    for (int c = 0; c < n_chunks; ++c) { 
+        const int begin = c * tokenize_chunk_size; 
+        const int end = std::min(n_texts, begin + tokenize_chunk_size); 
+        for (int i = begin; i < end; ++i) offsets[i + 1] += n_total; 
+        n_total += (int64_t)chunk_tokens[c].size(); 
+    } 
+    int32_t* tokens = new int32_t[std::max<int64_t>(n_total, 1)]; 
+    for (int c = 0; c < n_chunks; ++c) { 
+        std::copy(chunk_tokens[c].begin(), chunk_tokens[c].end(), tokens + offsets[c * tokenize_chunk_size]); 
+    } 
+    *tokens_out = tokens; 
+    *offsets_out = offsets; 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API void newrllama_free_offsets(int64_t* offsets) { 
+    if (offsets) delete[] offsets; 
+} 
+
+// Formats `messages` with the chat template `tmpl`. llama_chat_apply_template reports the full
+// length when the buffer is too small, so a long conversation costs one retry, not a truncation.
+static std::string chat_format(const char* tmpl, const std::vector<llama_chat_message>& messages, bool add_ass) { 
+    size_t total_length = 0; 
+    for (const auto& msg : messages) total_length += (msg.content ? strlen(msg.content) : 0); 
+    std::vector<char> buffer(total_length * 2 + 2048, 0); 
+    int32_t res = llama_chat_apply_template(tmpl, messages.data(), messages.size(), add_ass, buffer.data(), buffer.size()); 
+    if (res > (int32_t)buffer.size()) { 
+        buffer.resize(res); 
+        res = llama_chat_apply_template(tmpl, messages.data(), messages.size(), add_ass, buffer.data(), buffer.size()); 
+    } 
+    if (res < 0) { 
+        throw std::runtime_error("Failed to apply chat template. Error code: " + std::to_string(res)); 
+    } 
+    return std::string(buffer.data(), res); 
+} 
+
 NEWRLLAMA_API newrllama_error_code newrllama_apply_chat_template(newrllama_model_handle model, const char* tmpl, const struct newrllama_chat_message* messages_in, size_t n_messages, bool add_ass, char** result_out, const char** error_message) { 
     std::vector<llama_chat_message> messages_vec(n_messages); 
-    size_t total_length = 0; 
     for(size_t i = 0; i < n_messages; ++i) { 
         messages_vec[i] = {messages_in[i].role, messages_in[i].content}; 
-        total_length += (messages_in[i].content ? strlen(messages_in[i].content) : 0); 
     } 
-    size_t buffer_size = total_length * 2 + 2048; 
-    std::vector<char> buffer(buffer_size, 0); 
-    int32_t res = llama_chat_apply_template(tmpl, messages_vec.data(), n_messages, add_ass, buffer.data(), buffer.size()); 
-    if (res < 0) { 
-        set_error(error_message, "Failed to apply chat template. Error code: " + std::to_string(res)); 
+    try { 
+        *result_out = string_to_c_str(chat_format(tmpl, messages_vec, add_ass)); 
+        return NEWRLLAMA_SUCCESS; 
+    } catch (const std::exception& e) { 
+        set_error(error_message, e.what()); 
         return NEWRLLAMA_ERROR; 
     } 
-    *result_out = string_to_c_str(std::string(buffer.data(), res)); 
-    return NEWRLLAMA_SUCCESS; 
 }
 
-NEWRLLAMA_API newrllama_error_code newrllama_generate(newrllama_context_handle ctx, const int32_t* tokens_in, size_t n_tokens_in, int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, char** result_out, const char** error_message) { 
-    if (!ctx) { 
-        set_error(error_message, "Context handle is null."); 
-        return NEWRLLAMA_ERROR; 
+NEWRLLAMA_API struct newrllama_sampling_params newrllama_sampling_default_params() { 
+    newrllama_sampling_params params = {}; 
+    params.struct_size = sizeof(newrllama_sampling_params); 
+    params.max_tokens = 100; 
+    params.top_k = 40; 
+    params.top_p = 0.9f; 
+    params.temperature = 0.8f; 
+    params.repeat_last_n = 64; 
+    params.penalty_repeat = 1.1f; 
+    params.seed = -1; 
+    return params; 
+} 
+
+// The sampling settings of the entry points that take them as separate arguments.
+static newrllama_sampling_params sampling_params(int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed) { 
+    newrllama_sampling_params params = newrllama_sampling_default_params(); 
+    params.max_tokens = max_tokens; 
+    params.top_k = top_k; 
+    params.top_p = top_p; 
+    params.temperature = temperature; 
+    params.repeat_last_n = repeat_last_n; 
+    params.penalty_repeat = penalty_repeat; 
+    params.seed = seed; 
+    return params; 
+} 
+
+// The settings of the 1.0.40 entry points, which keep the unversioned newrllama_parallel_params.
+static newrllama_sampling_params legacy_params(const newrllama_parallel_params& p) { 
+    return sampling_params(p.max_tokens, p.top_k, p.top_p, p.temperature, p.repeat_last_n, p.penalty_repeat, p.seed); 
+} 
+
+// A caller's params at this library's layout: fields beyond its struct_size postdate its header
+// and keep their defaults. Every header had the fields through seed, so a smaller struct_size is
+// not a struct_size at all.
+static newrllama_sampling_params read_params(const newrllama_sampling_params* params_in) { 
+    if (params_in->struct_size < offsetof(newrllama_sampling_params, seed) + sizeof(int32_t)) { 
+        throw std::runtime_error("params->struct_size is too small; start from newrllama_sampling_default_params()."); 
     } 
-    const llama_model* model = llama_get_model(ctx); 
-    const struct llama_vocab* vocab = llama_model_get_vocab(model); 
-    llama_token eos_token = llama_vocab_eos(vocab); 
-    llama_batch batch = llama_batch_get_one((llama_token*)tokens_in, n_tokens_in); 
-    if (llama_decode(ctx, batch) != 0) { 
-        set_error(error_message, "Failed to decode input tokens."); 
-        return NEWRLLAMA_ERROR; 
+    newrllama_sampling_params params = newrllama_sampling_default_params(); 
+    std::memcpy(&params, params_in, std::min(params_in->struct_size, sizeof(params))); 
+    params.struct_size = sizeof(params); 
+    return params; 
+} 
+
+// n_params caller structs laid out with the caller's struct size as the array stride.
+static std::vector<newrllama_sampling_params> read_params(const newrllama_sampling_params* params_in, int n_params) { 
+    std::vector<newrllama_sampling_params> params; 
+    const char* at = reinterpret_cast<const char*>(params_in); 
+    for (int i = 0; i < n_params; ++i, at += params_in->struct_size) { 
+        params.push_back(read_params(reinterpret_cast<const newrllama_sampling_params*>(at))); 
     } 
+    return params; 
+} 
+
+// Sampler chain for one sequence: repetition penalty, top-k, top-p and temperature, then a
+// seeded draw (seed < 0: seeded from the clock).
+static llama_sampler* make_sampler(const newrllama_sampling_params& params) { 
     struct llama_sampler_chain_params sparams_chain = llama_sampler_chain_default_params(); 
     struct llama_sampler* sampler_chain = llama_sampler_chain_init(sparams_chain); 
-    llama_sampler_chain_add(sampler_chain, llama_sampler_init_penalties(repeat_last_n, penalty_repeat, 0.0f, 0.0f)); 
-    llama_sampler_chain_add(sampler_chain, llama_sampler_init_top_k(top_k)); 
-    llama_sampler_chain_add(sampler_chain, llama_sampler_init_top_p(top_p, 1)); 
-    llama_sampler_chain_add(sampler_chain, llama_sampler_init_temp(temperature)); 
-    uint32_t final_seed = (seed < 0) ? time(NULL) : seed; 
+    llama_sampler_chain_add(sampler_chain, llama_sampler_init_penalties(params.repeat_last_n, params.penalty_repeat, 0.0f, 0.0f)); 
+    llama_sampler_chain_add(sampler_chain, llama_sampler_init_top_k(params.top_k)); 
+    llama_sampler_chain_add(sampler_chain, llama_sampler_init_top_p(params.top_p, 1)); 
+    llama_sampler_chain_add(sampler_chain, llama_sampler_init_temp(params.temperature)); 
+    uint32_t final_seed = (params.seed < 0) ? time(NULL) : params.seed; 
     llama_sampler_chain_add(sampler_chain, llama_sampler_init_dist(final_seed)); 
-    std::string generated_text; 
-    for (int i = 0; i < max_tokens; ++i) { 
-        llama_token new_token = llama_sampler_sample(sampler_chain, ctx, -1); 
-        llama_sampler_accept(sampler_chain, new_token); 
-        if (new_token == eos_token || llama_vocab_is_eog(vocab, new_token)) break; 
-        generated_text += common_token_to_piece(ctx, new_token); 
-        llama_batch next_batch = llama_batch_get_one(&new_token, 1); 
-        if (llama_decode(ctx, next_batch) != 0) { 
-            llama_sampler_free(sampler_chain); 
-            set_error(error_message, "Failed to decode generated token."); 
-            return NEWRLLAMA_ERROR; 
+    return sampler_chain; 
+} 
+
+// Grammar sampler for a GBNF string; null when `grammar` is unset or empty. Throws when the
+// grammar does not parse.
+static llama_sampler* make_grammar_sampler(const llama_vocab* vocab, const char* grammar) { 
+    if (!grammar || !*grammar) return nullptr; 
+    llama_sampler* smpl = llama_sampler_init_grammar(vocab, grammar, "root"); 
+    if (!smpl) throw std::runtime_error("Failed to parse grammar."); 
+    return smpl; 
+} 
+
+// make_sampler's chain plus the optional grammar from `params`. The grammar first checks only
+// the token the chain picked; the whole vocabulary is masked (and the chain run again) just when
+// that token is rejected. Once the output is on track that is rare, so a constrained step costs
+// about one grammar check rather than one per vocabulary entry. sample() also accepts the token.
+struct token_sampler { 
+    const llama_vocab* vocab; 
+    llama_sampler* chain; 
+    llama_sampler* grammar; 
+    std::vector<llama_token_data> cur; 
+    token_sampler(const llama_vocab* v, const newrllama_sampling_params& params) : vocab(v), chain(nullptr), grammar(make_grammar_sampler(v, params.grammar)) { 
+        chain = make_sampler(params); 
+    } 
+    ~token_sampler() { 
+        llama_sampler_free(chain); 
+        if (grammar) llama_sampler_free(grammar); 
+    } 
+    token_sampler(const token_sampler&) = delete; 
+    token_sampler& operator=(const token_sampler&) = delete; 
+
+    llama_token_data_array fill(const float* logits) { 
+        const int32_t n_vocab = llama_vocab_n_tokens(vocab); 
+        cur.resize(n_vocab); 
+        for (llama_token id = 0; id < n_vocab; ++id) cur[id] = {id, logits[id], 0.0f}; 
+        return {cur.data(), cur.size(), -1, false}; 
+    } 
+
+    llama_token sample(llama_context* ctx, int32_t idx) { 
+        if (!grammar) return llama_sampler_sample(chain, ctx, idx);   // accepts the token itself
+        const float* logits = llama_get_logits_ith(ctx, idx); 
+        llama_token_data_array arr = fill(logits); 
+        llama_sampler_apply(chain, &arr); 
+        llama_token token = arr.data[arr.selected].id; 
+        llama_token_data single = {token, 1.0f, 0.0f}; 
+        llama_token_data_array single_arr = {&single, 1, -1, false}; 
+        llama_sampler_apply(grammar, &single_arr); 
+        if (std::isinf(single.logit)) { 
+            arr = fill(logits); 
+            llama_sampler_apply(grammar, &arr); 
+            llama_sampler_apply(chain, &arr); 
+            token = arr.data[arr.selected].id; 
         } 
+        llama_sampler_accept(grammar, token); 
+        llama_sampler_accept(chain, token); 
+        return token; 
     } 
-    llama_sampler_free(sampler_chain); 
-    *result_out = string_to_c_str(generated_text); 
-    return NEWRLLAMA_SUCCESS; 
-}
+}; 
 
-NEWRLLAMA_API newrllama_error_code newrllama_generate_parallel(newrllama_context_handle ctx, const char** prompts, int n_prompts, const struct newrllama_parallel_params* params, char*** results_out, const char** error_message) { 
-    if (!ctx || !params) { 
-        set_error(error_message, "Context or params handle is null."); 
-        return NEWRLLAMA_ERROR; 
+// Log-probabilities recorded while generating one text (newrllama_sampling_params.n_probs).
+struct token_probs { 
+    int n_probs = 0; 
+    std::vector<int32_t> token; 
+    std::vector<float> logprob; 
+    std::vector<int32_t> top_token; 
+    std::vector<float> top_logprob; 
+    std::vector<int32_t> order;   // scratch for picking the top n_probs
+
+    // Records `tok`, chosen from `logits`: log-softmax over the vocabulary, then the n_probs
+    // best entries by partial sort (padded with -1 / -inf on a smaller vocabulary).
+    void add(const float* logits, int32_t n_vocab, llama_token tok) { 
+        const float max_logit = *std::max_element(logits, logits + n_vocab); 
+        double sum = 0.0; 
+        for (int32_t i = 0; i < n_vocab; ++i) sum += std::exp((double)(logits[i] - max_logit)); 
+        const float log_norm = max_logit + (float)std::log(sum); 
+        token.push_back(tok); 
+        logprob.push_back(logits[tok] - log_norm); 
+        const int n_top = std::min(n_probs, n_vocab); 
+        order.resize(n_vocab); 
+        std::iota(order.begin(), order.end(), 0); 
+        std::partial_sort(order.begin(), order.begin() + n_top, order.end(), [logits](int32_t a, int32_t b) { return logits[a] > logits[b]; }); 
+        for (int k = 0; k < n_probs; ++k) { 
+            top_token.push_back(k < n_top ? order[k] : -1); 
+            top_logprob.push_back(k < n_top ? logits[order[k]] - log_norm : -INFINITY); 
+        } 
     } 
-    const llama_model* model = llama_get_model(ctx); 
-    const llama_vocab* vocab = llama_model_get_vocab(model); 
-    const llama_token eos_token = llama_vocab_eos(vocab); 
-    common_params_sampling sparams{}; 
-    sparams.top_k = params->top_k; 
-    sparams.top_p = params->top_p; 
-    sparams.temp = params->temperature; 
-    sparams.penalty_last_n = params->repeat_last_n; 
-    sparams.penalty_repeat = params->penalty_repeat; 
-    uint32_t final_seed = (params->seed < 0) ? time(NULL) : params->seed; 
-    sparams.seed = final_seed; 
-    struct Client { 
-        int id; 
-        llama_seq_id seq_id; 
-        std::vector<llama_token> prompt_tokens; 
-        size_t n_decoded = 0; 
-        std::string response; 
-        llama_token sampled = 0; 
-        common_sampler* smpl = nullptr; 
-        bool finished = false; 
+}; 
+
+static void token_probs_to_c(const token_probs& probs, newrllama_token_probs* out) { 
+    const size_t n = probs.token.size(); 
+    const size_t n_top = probs.top_token.size(); 
+    out->n_tokens = (int64_t)n; 
+    out->n_probs = probs.n_probs; 
+    out->token = new int32_t[n]; 
+    out->logprob = new float[n]; 
+    out->top_token = new int32_t[n_top]; 
+    out->top_logprob = new float[n_top]; 
+    std::copy(probs.token.begin(), probs.token.end(), out->token); 
+    std::copy(probs.logprob.begin(), probs.logprob.end(), out->logprob); 
+    std::copy(probs.top_token.begin(), probs.top_token.end(), out->top_token); 
+    std::copy(probs.top_logprob.begin(), probs.top_logprob.end(), out->top_logprob); 
+} 
+
+// Speculative generation in sequence `seq`. Drafts come from `draft_ctx` (a small model with
+// the target's vocabulary, run greedily in its sequence 0) or, when it is null, from prompt
+// lookup over the sequence's tokens. The target decodes its last token and up to n_draft drafts
+// in one batch and its own sampler walks that batch, keeping drafts for as long as they equal
+// what it samples; the first mismatch is replaced by the target's token. The text therefore
+// follows the target's sampling exactly and only the number of target decode calls shrinks.
+// Both contexts keep their prompt caches. `callback`, `probs` and `trace` work as in
+// generate_single. Throws on decode failure.
+static std::string generate_speculative(llama_context* ctx, llama_context* draft_ctx, llama_seq_id seq, const int32_t* tokens_in, size_t n_tokens_in, const newrllama_sampling_params& params, int n_draft, newrllama_token_callback callback, void* user_data, newrllama_perf_stats* stats, const std::atomic<bool>* cancel, token_probs* probs = nullptr, sequence_trace* trace = nullptr) { 
+    context_state& state = get_context_state(ctx); 
+    std::unique_lock<std::mutex> run_lock(state.run_mutex, std::defer_lock); 
+    std::unique_lock<std::mutex> draft_run_lock; 
+    if (draft_ctx) { 
+        draft_run_lock = std::unique_lock<std::mutex>(get_context_state(draft_ctx).run_mutex, std::defer_lock); 
+        std::lock(run_lock, draft_run_lock); 
+    } else { 
+        run_lock.lock(); 
+    } 
+    const auto t_start = std::chrono::steady_clock::now(); 
+    const struct llama_vocab* vocab = llama_model_get_vocab(llama_get_model(ctx)); 
+    if (draft_ctx) { 
+        const struct llama_vocab* draft_vocab = llama_model_get_vocab(llama_get_model(draft_ctx)); 
+        if (llama_vocab_n_tokens(vocab) != llama_vocab_n_tokens(draft_vocab) || llama_vocab_bos(vocab) != llama_vocab_bos(draft_vocab) || llama_vocab_eos(vocab) != llama_vocab_eos(draft_vocab)) { 
+            throw std::runtime_error("The draft model's vocabulary does not match the target model's."); 
+        } 
+        // The draft's sequence 0 mirrors the target's sequence, shifts included.
+        if (context_seq_size(draft_ctx) < context_seq_size(ctx)) { 
+            throw std::runtime_error("The draft context holds " + std::to_string(context_seq_size(draft_ctx)) + " tokens per sequence, fewer than the target's " + std::to_string(context_seq_size(ctx)) + "."); 
+        } 
+        if (state.ctx_shift && !llama_kv_self_can_shift(draft_ctx)) { 
+            throw std::runtime_error("ctx_shift is not supported by the draft model's KV cache."); 
+        } 
+    } 
+    if (n_tokens_in == 0) throw std::runtime_error("Speculative decoding needs a non-empty prompt."); 
+    const size_t n_batch = llama_n_batch(ctx); 
+    n_draft = std::max(0, std::min(n_draft, (int)n_batch - 1)); 
+    std::vector<llama_token>& cached = state.seq_tokens[seq]; 
+    std::vector<llama_token> no_draft_cache; 
+    std::vector<llama_token>& draft_cached = draft_ctx ? get_context_state(draft_ctx).seq_tokens[0] : no_draft_cache; 
+    scoped_batch batch((int32_t)n_batch); 
+    scoped_batch draft_batch(draft_ctx ? (int32_t)llama_n_batch(draft_ctx) : 1); 
+    token_sampler sampler(vocab, params); 
+    std::unique_ptr<llama_sampler, decltype(&llama_sampler_free)> draft_sampler(llama_sampler_init_greedy(), llama_sampler_free); 
+    auto reset = [&]() { 
+        llama_kv_self_seq_rm(ctx, seq, -1, -1); 
+        cached.clear(); 
+        if (draft_ctx) llama_kv_self_seq_rm(draft_ctx, 0, -1, -1); 
+        draft_cached.clear(); 
     }; 
-    std::vector<Client> clients(n_prompts); 
-    try { 
-        for (int i = 0; i < n_prompts; ++i) { 
-            auto& C = clients[i]; 
-            C.id = i; 
-            C.seq_id = i; 
-            C.prompt_tokens = helper_tokenize(model, std::string(prompts[i]), true); 
-            C.smpl = common_sampler_init(model, sparams); 
-            if (!C.smpl) throw std::runtime_error("Sampler init failed for client " + std::to_string(i)); 
+    // Drops rejected drafts: KV entries of `s` from position n on.
+    auto trim_kv = [&](llama_context* c, llama_seq_id s, size_t n) { 
+        if (!llama_kv_self_seq_rm(c, s, (llama_pos)n, -1)) { 
+            reset(); 
+            throw std::runtime_error("Speculative decoding needs a KV cache that supports partial removal."); 
         } 
-        llama_kv_self_clear(ctx); 
-        int active = n_prompts; 
-        while (active > 0) { 
-            llama_batch batch = llama_batch_init(512, 0, active); 
-            int batch_idx = 0; 
-            for (auto& C : clients) { 
-                if (C.finished) continue; 
-                if (C.n_decoded == 0) { 
-                    for (size_t k = 0; k < C.prompt_tokens.size() && batch.n_tokens < 512; ++k) { 
-                        common_batch_add(batch, C.prompt_tokens[k], k, {C.seq_id}, false); 
+    }; 
+
+    // Prefill: the target needs logits for its first token, the draft only the KV entries.
+    const size_t n_reused = reuse_cached_prefix(ctx, seq, cached, tokens_in, n_tokens_in); 
+    if (decode_chunked(ctx, batch.batch, seq, cached, tokens_in + n_reused, n_tokens_in - n_reused, cancel) != 0) { 
+        reset(); 
+        throw std::runtime_error("Failed to decode input tokens."); 
+    } 
+    if (draft_ctx) { 
+        const size_t n_draft_reused = reuse_cached_prefix(draft_ctx, 0, draft_cached, tokens_in, n_tokens_in, false); 
+        if (decode_chunked(draft_ctx, draft_batch.batch, 0, draft_cached, tokens_in + n_draft_reused, n_tokens_in - n_draft_reused, cancel) != 0) { 
+            reset(); 
+            throw std::runtime_error("Failed to decode input tokens."); 
+        } 
+        llama_synchronize(draft_ctx); 
+    } 
+    llama_synchronize(ctx); 
+    const size_t n_prefilled = cached.size(); 
+    const double t_prefill_ms = elapsed_ms(t_start); 
+    const int n_prefill_calls = (int)((n_tokens_in - n_reused + n_batch - 1) / n_batch); 
+    int n_decode_calls = n_prefill_calls; 
+    int64_t n_batch_tokens = (int64_t)(n_tokens_in - n_reused); 
+    int64_t n_generated = 0; 
+    int64_t n_drafted = 0; 
+    int64_t n_accepted = 0; 
+    double t_decode_ms = 0.0; 
+    double t_draft_ms = 0.0; 
+    double t_sample_ms = 0.0; 
+    double t_detokenize_ms = 0.0; 
+    const size_t n_ctx_seq = context_seq_size(ctx); 
+    const size_t n_keep = state.n_keep < 0 ? n_tokens_in : (size_t)state.n_keep; 
+    int n_context_shifts = 0; 
+    size_t n_discarded = 0; 
+
+    std::string generated_text; 
+    generated_text.reserve((size_t)std::min(std::max(params.max_tokens, 0), 4096) * 4 + 16); 
+    size_t n_streamed = 0; 
+    const stop_matcher stop(params); 
+    // Appends a sampled token; false once generation is over (end of generation, max_tokens, a
+    // stop string or the callback asking to stop).
+    auto emit = [&](llama_token token) { 
+        if (llama_vocab_is_eog(vocab, token)) return false; 
+        const auto t0 = std::chrono::steady_clock::now(); 
+        const size_t n_old = generated_text.size(); 
+        token_piece_append(vocab, token, generated_text); 
+        t_detokenize_ms += elapsed_ms(t0); 
+        const size_t stop_pos = stop.find(generated_text, n_old); 
+        if (stop_pos != std::string::npos) { 
+            generated_text.resize(std::max(stop_pos, n_streamed)); 
+            ++n_generated; 
+            return false; 
+        } 
+        if (callback) { 
+            const size_t n_ready = stop.ready_length(generated_text); 
+            if (n_ready > n_streamed) { 
+                const bool keep_going = callback(generated_text.data() + n_streamed, n_ready - n_streamed, token, user_data); 
+                n_streamed = n_ready; 
+                if (!keep_going) { 
+                    ++n_generated; 
+                    return false; 
+                } 
+            } 
+        } 
+        return ++n_generated < params.max_tokens; 
+    }; 
+    auto sample = [&](int32_t idx) { 
+        const auto t0 = std::chrono::steady_clock::now(); 
+        llama_token token = sampler.sample(ctx, idx); 
+        // Every sampled token is kept (or ends generation), so its probabilities belong to the text.
+        if (probs && !llama_vocab_is_eog(vocab, token)) probs->add(llama_get_logits_ith(ctx, idx), llama_vocab_n_tokens(vocab), token); 
+        t_sample_ms += elapsed_ms(t0); 
+        return token; 
+    }; 
+
+    if (params.max_tokens > 0 && !(cancel && *cancel)) { 
+        // `last` is the newest accepted token; it is in neither KV cache yet.
+        llama_token last = sample(-1); 
+        bool going = emit(last); 
+        std::vector<llama_token> drafts; 
+        while (going && !(cancel && *cancel)) { 
+            // Drafting stops early where the remaining budget could not use more tokens.
+            const int n_want = (int)std::min<int64_t>(n_draft, params.max_tokens - n_generated - 1); 
+            if (state.ctx_shift) { 
+                // The draft model's cache mirrors a prefix of the target's and is shifted alike.
+                const size_t n_discard = context_shift_size(cached.size(), 1 + (size_t)n_want, n_ctx_seq, n_keep); 
+                if (n_discard == std::string::npos) break; 
+                if (n_discard > 0) { 
+                    context_shift(ctx, seq, cached, n_keep, n_discard); 
+                    if (draft_ctx) context_shift(draft_ctx, 0, draft_cached, n_keep, n_discard); 
+                    n_context_shifts++; 
+                    n_discarded += n_discard; 
+                } 
+            } 
+            drafts.clear(); 
+            auto t0 = std::chrono::steady_clock::now(); 
+            if (n_want > 0 && !draft_ctx) { 
+                cached.push_back(last); 
+                lookup_draft(cached, state.lookup_ngram_max, n_want, drafts); 
+                cached.pop_back(); 
+            } else if (n_want > 0) { 
+                // The draft model lags by the tokens it never decoded (the previous round's last
+                // accepted draft, if any) plus `last`; feed those, then draft one token per decode.
+                std::vector<llama_token> pending(cached.begin() + draft_cached.size(), cached.end()); 
+                pending.push_back(last); 
+                while (true) { 
+                    common_batch_clear(draft_batch.batch); 
+                    for (size_t k = 0; k < pending.size(); ++k) { 
+                        common_batch_add(draft_batch.batch, pending[k], (llama_pos)(draft_cached.size() + k), {0}, k + 1 == pending.size()); 
                     } 
-                    C.n_decoded = C.prompt_tokens.size(); 
-                    if (batch.n_tokens > 0) batch.logits[batch.n_tokens - 1] = true; 
-                } else { 
-                    common_batch_add(batch, C.sampled, C.n_decoded, {C.seq_id}, true); 
-                    C.n_decoded++; 
+                    if (llama_decode(draft_ctx, draft_batch.batch) != 0) { 
+                        reset(); 
+                        throw std::runtime_error("Failed to decode draft tokens."); 
+                    } 
+                    draft_cached.insert(draft_cached.end(), pending.begin(), pending.end()); 
+                    drafts.push_back(llama_sampler_sample(draft_sampler.get(), draft_ctx, -1)); 
+                    if ((int)drafts.size() == n_want) break; 
+                    pending.assign(1, drafts.back()); 
                 } 
             } 
-            if (batch.n_tokens == 0) { 
-                llama_batch_free(batch); 
-                break; 
+            t_draft_ms += elapsed_ms(t0); 
+
+            // Verify: `last` and the drafts in one target batch, with logits at every position.
+            t0 = std::chrono::steady_clock::now(); 
+            common_batch_clear(batch.batch); 
+            common_batch_add(batch.batch, last, (llama_pos)cached.size(), {seq}, true); 
+            for (size_t k = 0; k < drafts.size(); ++k) { 
+                common_batch_add(batch.batch, drafts[k], (llama_pos)(cached.size() + 1 + k), {seq}, true); 
             } 
-            if (llama_decode(ctx, batch) != 0) { 
-                llama_batch_free(batch); 
-                throw std::runtime_error("Parallel generation decoding failed."); 
+            if (llama_decode(ctx, batch.batch) != 0) { 
+                reset(); 
+                throw std::runtime_error("Failed to decode generated tokens."); 
             } 
-            int current_batch_idx = 0; 
-            for (auto& C : clients) { 
-                if (C.finished) continue; 
-                if (batch.logits[current_batch_idx]) { 
-                    llama_token tok = common_sampler_sample(C.smpl, ctx, current_batch_idx); 
-                    common_sampler_accept(C.smpl, tok, true); 
-                    if (tok == eos_token || (params->max_tokens > 0 && C.response.length() >= (size_t)params->max_tokens) || llama_vocab_is_eog(vocab, tok)) { 
-                        C.finished = true; 
-                        active--; 
-                    } else { 
-                        C.response += common_token_to_piece(ctx, tok); 
-                        C.sampled = tok; 
-                    } 
+            llama_synchronize(ctx); 
+            t_decode_ms += elapsed_ms(t0); 
+            n_decode_calls++; 
+            n_batch_tokens += (int64_t)drafts.size() + 1; 
+            n_drafted += (int64_t)drafts.size(); 
+            cached.push_back(last); 
+
+            size_t n_ok = 0; 
+            llama_token next = last; 
+            while (going) { 
+                next = sample((int32_t)n_ok); 
+                if (n_ok == drafts.size() || next != drafts[n_ok]) break; 
+                // An end-of-generation draft ends the text without being accepted into it.
+                if (llama_vocab_is_eog(vocab, next)) { 
+                    going = false; 
+                    break; 
                 } 
-                current_batch_idx++; 
+                n_ok++; 
+                going = emit(next); 
+            } 
+            n_accepted += (int64_t)n_ok; 
+            cached.insert(cached.end(), drafts.begin(), drafts.begin() + n_ok); 
+            if (n_ok < drafts.size()) trim_kv(ctx, seq, cached.size()); 
+            if (draft_cached.size() > cached.size()) { 
+                draft_cached.resize(cached.size()); 
+                trim_kv(draft_ctx, 0, cached.size()); 
+            } 
+            if (!going) break; 
+            last = next; 
+            going = emit(last); 
+        } 
+    } 
+    if (callback && generated_text.size() > n_streamed) { 
+        callback(generated_text.data() + n_streamed, generated_text.size() - n_streamed, -1, user_data); 
+    } 
+    if (trace) *trace = trace_sequence(n_tokens_in, n_prefilled, n_keep, n_discarded, cached.size()); 
+
+    if (stats) { 
+        const int64_t n_prompt = (int64_t)(n_tokens_in - n_reused); 
+        *stats = {}; 
+        stats->n_slots = 1; 
+        stats->n_prompts = 1; 
+        stats->n_prompt_tokens = n_prompt; 
+        stats->n_reused_prompt_tokens = (int64_t)n_reused; 
+        stats->n_generated_tokens = n_generated; 
+        stats->n_decode_calls = n_decode_calls; 
+        stats->t_total_ms = elapsed_ms(t_start); 
+        stats->t_prefill_ms = t_prefill_ms; 
+        stats->t_decode_ms = t_decode_ms; 
+        stats->t_sample_ms = t_sample_ms; 
+        stats->t_detokenize_ms = t_detokenize_ms; 
+        stats->tokens_per_second = stats->t_total_ms > 0.0 ? (n_prompt + n_generated) * 1000.0 / stats->t_total_ms : 0.0; 
+        stats->avg_batch_fill = n_decode_calls > 0 ? (double)n_batch_tokens / ((double)n_decode_calls * n_batch) : 0.0; 
+        stats->avg_slot_occupancy = n_decode_calls > 0 ? 1.0 : 0.0; 
+        stats->n_kv_cells_used = llama_kv_self_used_cells(ctx); 
+        stats->n_drafted_tokens = n_drafted; 
+        stats->n_accepted_tokens = n_accepted; 
+        stats->t_draft_ms = t_draft_ms; 
+        stats->n_context_shifts = n_context_shifts; 
+    } 
+    return generated_text; 
+} 
+
+// Single-sequence generation loop shared by newrllama_generate, newrllama_generate_stream and
+// pool leases; it runs in sequence `seq` and leaves the other sequences' KV contents alone.
+// Contexts with prompt lookup enabled are handed to generate_speculative. When `callback` is
+// set, text is handed out as soon as it forms complete UTF-8 characters; the callback
+// returning false stops generation early. With `probs` set and params.n_probs > 0, each
+// generated token's log-probabilities are recorded there. Throws on decode failure.
+// Prefill and decode times are taken from llama_perf_context, which tells single-token decodes
+// apart from prompt batches; sampling and detokenization are timed here. A set `cancel` flag
+// ends generation between llama_decode calls and returns the text produced so far.
+// On a ctx_shift context a full sequence is shifted before the next decode; generation ends
+// instead when the kept tokens leave nothing to discard. `trace`, if set, receives where the
+// prompt and generated tokens ended up in the sequence.
+static std::string generate_single(llama_context* ctx, llama_seq_id seq, const int32_t* tokens_in, size_t n_tokens_in, const newrllama_sampling_params& params, newrllama_token_callback callback, void* user_data, newrllama_perf_stats* stats = nullptr, const std::atomic<bool>* cancel = nullptr, token_probs* probs = nullptr, sequence_trace* trace = nullptr) { 
+    if (probs) probs->n_probs = params.n_probs; 
+    if (params.n_probs <= 0) probs = nullptr; 
+    const int lookup_n_draft = get_context_state(ctx).lookup_n_draft; 
+    if (lookup_n_draft > 0 && n_tokens_in > 0) { 
+        return generate_speculative(ctx, nullptr, seq, tokens_in, n_tokens_in, params, lookup_n_draft, callback, user_data, stats, cancel, probs, trace); 
+    } 
+    context_state& state = get_context_state(ctx); 
+    std::lock_guard<std::mutex> run_lock(state.run_mutex); 
+    const auto t_start = std::chrono::steady_clock::now(); 
+    const llama_perf_context_data perf_start = llama_perf_context(ctx); 
+    const llama_model* model = llama_get_model(ctx); 
+    const struct llama_vocab* vocab = llama_model_get_vocab(model); 
+    llama_token eos_token = llama_vocab_eos(vocab); 
+    token_sampler sampler(vocab, params); 
+    // Only the part of the prompt after the prefix already cached in `seq` is decoded.
+    std::vector<llama_token>& cached = state.seq_tokens[seq]; 
+    const size_t n_ctx_seq = context_seq_size(ctx); 
+    const size_t n_keep = state.n_keep < 0 ? n_tokens_in : (size_t)state.n_keep; 
+    int n_context_shifts = 0; 
+    size_t n_discarded = 0; 
+    const size_t n_reused = reuse_cached_prefix(ctx, seq, cached, tokens_in, n_tokens_in); 
+    const size_t n_batch = llama_n_batch(ctx); 
+    scoped_batch batch((int32_t)n_batch); 
+    const int n_prefill_calls = (int)((n_tokens_in - n_reused + n_batch - 1) / n_batch); 
+    int n_decode_calls = n_prefill_calls; 
+    int64_t n_generated = 0; 
+    double t_sample_ms = 0.0; 
+    double t_detokenize_ms = 0.0; 
+    if (decode_chunked(ctx, batch.batch, seq, cached, tokens_in + n_reused, n_tokens_in - n_reused, cancel) != 0) { 
+        llama_kv_self_seq_rm(ctx, seq, -1, -1); 
+        cached.clear(); 
+        throw std::runtime_error("Failed to decode input tokens."); 
+    } 
+    const size_t n_prefilled = cached.size(); 
+    // Pieces are appended in place; reserving up front avoids regrowing for typical outputs.
+    std::string generated_text; 
+    generated_text.reserve((size_t)std::min(std::max(params.max_tokens, 0), 4096) * 4 + 16); 
+    size_t n_streamed = 0; 
+    const stop_matcher stop(params); 
+    for (int i = 0; i < params.max_tokens; ++i) { 
+        if (cancel && *cancel) break; 
+        auto t0 = std::chrono::steady_clock::now(); 
+        llama_token new_token = sampler.sample(ctx, -1); 
+        t_sample_ms += elapsed_ms(t0); 
+        if (new_token == eos_token || llama_vocab_is_eog(vocab, new_token)) break; 
+        if (probs) probs->add(llama_get_logits_ith(ctx, -1), llama_vocab_n_tokens(vocab), new_token); 
+        t0 = std::chrono::steady_clock::now(); 
+        const size_t n_old = generated_text.size(); 
+        token_piece_append(vocab, new_token, generated_text); 
+        t_detokenize_ms += elapsed_ms(t0); 
+        n_generated++; 
+        const size_t stop_pos = stop.find(generated_text, n_old); 
+        if (stop_pos != std::string::npos) { 
+            generated_text.resize(std::max(stop_pos, n_streamed)); 
+            break; 
+        } 
+        if (callback) { 
+            const size_t n_ready = stop.ready_length(generated_text); 
+            if (n_ready > n_streamed) { 
+                const bool keep_going = callback(generated_text.data() + n_streamed, n_ready - n_streamed, new_token, user_data); 
+                n_streamed = n_ready; 
+                if (!keep_going) break; 
+            } 
+        } 
+        // The budget's last token is not decoded: nothing would sample from its logits.
+        if (i + 1 == params.max_tokens) break; 
+        if (state.ctx_shift) { 
+            const size_t n_discard = context_shift_size(cached.size(), 1, n_ctx_seq, n_keep); 
+            if (n_discard == std::string::npos) break;   // n_keep fills the sequence: end here
+            if (n_discard > 0) { 
+                context_shift(ctx, seq, cached, n_keep, n_discard); 
+                n_context_shifts++; 
+                n_discarded += n_discard; 
             } 
-            llama_batch_free(batch); 
         } 
+        common_batch_clear(batch.batch); 
+        common_batch_add(batch.batch, new_token, (llama_pos)cached.size(), {seq}, true); 
+        if (llama_decode(ctx, batch.batch) != 0) { 
+            llama_kv_self_seq_rm(ctx, seq, -1, -1); 
+            cached.clear(); 
+            throw std::runtime_error("Failed to decode generated token."); 
+        } 
+        n_decode_calls++; 
+        cached.push_back(new_token); 
+    } 
+    if (callback && generated_text.size() > n_streamed) { 
+        callback(generated_text.data() + n_streamed, generated_text.size() - n_streamed, -1, user_data); 
+    } 
+    if (trace) *trace = trace_sequence(n_tokens_in, n_prefilled, n_keep, n_discarded, cached.size()); 
+    if (stats) { 
+        // The last generated token's decode is still in flight; wait so its time is counted.
+        llama_synchronize(ctx); 
+        const llama_perf_context_data perf_end = llama_perf_context(ctx); 
+        const int64_t n_prompt = (int64_t)(n_tokens_in - n_reused); 
+        *stats = {}; 
+        stats->n_slots = 1; 
+        stats->n_prompts = 1; 
+        stats->n_prompt_tokens = n_prompt; 
+        stats->n_reused_prompt_tokens = (int64_t)n_reused; 
+        stats->n_generated_tokens = n_generated; 
+        stats->n_decode_calls = n_decode_calls; 
+        stats->t_total_ms = elapsed_ms(t_start); 
+        stats->t_prefill_ms = perf_end.t_p_eval_ms - perf_start.t_p_eval_ms; 
+        stats->t_decode_ms = perf_end.t_eval_ms - perf_start.t_eval_ms; 
+        stats->t_sample_ms = t_sample_ms; 
+        stats->t_detokenize_ms = t_detokenize_ms; 
+        stats->tokens_per_second = stats->t_total_ms > 0.0 ? (n_prompt + n_generated) * 1000.0 / stats->t_total_ms : 0.0; 
+        stats->avg_batch_fill = n_decode_calls > 0 ? (double)(n_prompt + n_decode_calls - n_prefill_calls) / ((double)n_decode_calls * n_batch) : 0.0; 
+        stats->avg_slot_occupancy = n_decode_calls > 0 ? 1.0 : 0.0; 
+        stats->n_kv_cells_used = llama_kv_self_used_cells(ctx); 
+        stats->n_context_shifts = n_context_shifts; 
+    } 
+    return generated_text; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate(newrllama_context_handle ctx, const int32_t* tokens_in, size_t n_tokens_in, int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, char** result_out, const char** error_message) { 
+    if (!ctx) { 
+        set_error(error_message, "Context handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const newrllama_sampling_params params = sampling_params(max_tokens, top_k, top_p, temperature, repeat_last_n, penalty_repeat, seed); 
+    try { 
+        *result_out = string_to_c_str(generate_single(ctx, 0, tokens_in, n_tokens_in, params, nullptr, nullptr)); 
+        return NEWRLLAMA_SUCCESS; 
     } catch (const std::exception& e) { 
-        for(auto& C : clients) if (C.smpl) common_sampler_free(C.smpl); 
         set_error(error_message, e.what()); 
         return NEWRLLAMA_ERROR; 
     } 
-    for (auto& C : clients) if (C.smpl) common_sampler_free(C.smpl); 
-    *results_out = new char*[n_prompts]; 
-    for (int i = 0; i < n_prompts; ++i) { 
-        (*results_out)[i] = string_to_c_str(clients[i].response); 
-    } 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate_stream(newrllama_context_handle ctx, const int32_t* tokens_in, size_t n_tokens_in, int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, newrllama_token_callback callback, void* user_data, char** result_out, const char** error_message) { 
+    if (!ctx) { 
+        set_error(error_message, "Context handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const newrllama_sampling_params params = sampling_params(max_tokens, top_k, top_p, temperature, repeat_last_n, penalty_repeat, seed); 
+    try { 
+        *result_out = string_to_c_str(generate_single(ctx, 0, tokens_in, n_tokens_in, params, callback, user_data)); 
+        return NEWRLLAMA_SUCCESS; 
+    } catch (const std::exception& e) { 
+        set_error(error_message, e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate_ext(newrllama_context_handle ctx, const int32_t* tokens_in, size_t n_tokens_in, const struct newrllama_sampling_params* params, newrllama_token_callback callback, void* user_data, char** result_out, struct newrllama_perf_stats* stats_out, struct newrllama_token_probs* probs_out, const char** error_message) { 
+    if (!ctx || !params) { 
+        set_error(error_message, "Context or params handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    try { 
+        token_probs probs; 
+        *result_out = string_to_c_str(generate_single(ctx, 0, tokens_in, n_tokens_in, read_params(params), callback, user_data, stats_out, nullptr, &probs)); 
+        if (probs_out) token_probs_to_c(probs, probs_out); 
+        return NEWRLLAMA_SUCCESS; 
+    } catch (const std::exception& e) { 
+        set_error(error_message, e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_json_schema_to_grammar(const char* schema_json, char** grammar_out, const char** error_message) { 
+    if (!schema_json || !grammar_out) { 
+        set_error(error_message, "Schema or output pointer is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    try { 
+        *grammar_out = string_to_c_str(json_schema_to_grammar(nlohmann::ordered_json::parse(schema_json))); 
+        return NEWRLLAMA_SUCCESS; 
+    } catch (const std::exception& e) { 
+        set_error(error_message, std::string("Failed to convert JSON schema: ") + e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate_speculative(newrllama_context_handle ctx, newrllama_context_handle draft_ctx, const int32_t* tokens_in, size_t n_tokens_in, const struct newrllama_sampling_params* params, int n_draft, char** result_out, struct newrllama_perf_stats* stats_out, const char** error_message) { 
+    if (!ctx || !draft_ctx || !params) { 
+        set_error(error_message, "Context, draft context or params is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (ctx == draft_ctx) { 
+        set_error(error_message, "The draft context must differ from the target context."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    try { 
+        *result_out = string_to_c_str(generate_speculative(ctx, draft_ctx, 0, tokens_in, n_tokens_in, read_params(params), n_draft, nullptr, nullptr, stats_out, nullptr)); 
+        return NEWRLLAMA_SUCCESS; 
+    } catch (const std::exception& e) { 
+        set_error(error_message, e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+} 
+
+// Shortest prefix shared by all prompts of a parallel run that is worth decoding once and forking.
+static const size_t min_shared_prefix = 32; 
+
+// Continuous-batching scheduler: a fixed pool of min(n_seq_max, n_prompts, n_batch) sequence
+// slots is fed from the queue of pending prompts. As soon as a slot's sequence finishes, the next
+// pending prompt is admitted into it, so the decode batch stays full. A slot's KV cache is
+// trimmed to the prefix it shares with the new prompt rather than cleared. A set `cancel` flag
+// stops the run between llama_decode steps, leaving the partial responses. Throws on failure.
+// `params` holds n_params entries: one shared by every prompt, or one per prompt. Each prompt
+// gets its own sampler, so requests with different settings share the decode batches. A shared
+// seed is offset by the prompt index, so identical prompts still draw independent samples.
+// On a ctx_shift context a generating sequence that fills its share of the KV cache is shifted
+// in place; one whose kept tokens leave nothing to discard is finished with its text so far.
+static void generate_parallel_impl(llama_context* ctx, const char** prompts, int n_prompts, const newrllama_sampling_params* params, int n_params, const std::atomic<bool>* cancel, std::vector<std::string>& responses, newrllama_perf_stats* stats_out, std::vector<token_probs>* probs = nullptr) { 
+    std::lock_guard<std::mutex> run_lock(get_context_state(ctx).run_mutex); 
+    const auto t_start = std::chrono::steady_clock::now(); 
+    const llama_model* model = llama_get_model(ctx); 
+    const llama_vocab* vocab = llama_model_get_vocab(model); 
+    const llama_token eos_token = llama_vocab_eos(vocab); 
+    if (n_params != 1 && n_params != std::max(n_prompts, 0)) { 
+        throw std::runtime_error("Expected 1 or " + std::to_string(n_prompts) + " sets of sampling parameters, got " + std::to_string(n_params) + "."); 
+    } 
+    auto params_of = [&](int client) -> const newrllama_sampling_params& { return params[n_params == 1 ? 0 : client]; }; 
+    const uint32_t time_seed = (uint32_t)time(NULL); 
+    auto sampling_of = [&](int client) { 
+        const newrllama_sampling_params& p = params_of(client); 
+        common_params_sampling sparams{}; 
+        sparams.top_k = p.top_k; 
+        sparams.top_p = p.top_p; 
+        sparams.temp = p.temperature; 
+        sparams.penalty_last_n = p.repeat_last_n; 
+        sparams.penalty_repeat = p.penalty_repeat; 
+        sparams.seed = (p.seed < 0 ? time_seed : (uint32_t)p.seed) + (p.seed < 0 || n_params == 1 ? (uint32_t)client : 0u); 
+        if (p.grammar && *p.grammar) sparams.grammar = p.grammar; 
+        return sparams; 
+    }; 
+    // Reject a bad grammar up front rather than when its prompt is admitted.
+    const char* checked_grammar = nullptr; 
+    for (int i = 0; i < n_params; ++i) { 
+        const char* grammar = params[i].grammar; 
+        if (!grammar || !*grammar || (checked_grammar && std::strcmp(grammar, checked_grammar) == 0)) continue; 
+        llama_sampler_free(make_grammar_sampler(vocab, grammar)); 
+        checked_grammar = grammar; 
+    } 
+    struct Slot { 
+        llama_seq_id seq_id = 0; 
+        int client = -1;               // index into prompts, -1 when the slot is free
+        std::vector<llama_token> prompt_tokens; 
+        llama_pos n_past = 0;          // tokens of this sequence already in the batch or KV cache
+        llama_pos n_discarded = 0;     // tokens dropped by context shifts, no longer in n_past
+        bool prefilled() const { return n_past + n_discarded >= (llama_pos)prompt_tokens.size(); } 
+        llama_token sampled = 0; 
+        int32_t i_batch = -1;          // batch index holding this slot's logits for the current step
+        std::vector<llama_token> drafts;   // prompt-lookup drafts decoded after `sampled` this step
+        common_sampler* smpl = nullptr; 
+        int n_generated = 0;           // tokens appended to the response, for max_tokens
+        stop_matcher stop; 
+    }; 
+    const int n_batch = (int)llama_n_batch(ctx); 
+    const int n_slots = parallel_slot_count((int)llama_n_seq_max(ctx), n_prompts, n_batch); 
+    const int n_ubatch = (int)llama_n_ubatch(ctx); 
+    std::vector<Slot> slots(n_slots); 
+    for (int s = 0; s < n_slots; ++s) slots[s].seq_id = s; 
+    responses.assign(std::max(n_prompts, 0), std::string()); 
+    if (probs) { 
+        probs->assign(responses.size(), token_probs()); 
+        for (size_t i = 0; i < probs->size(); ++i) (*probs)[i].n_probs = std::max(params_of((int)i).n_probs, 0); 
+    } 
+    llama_batch batch = llama_batch_init(n_batch, 0, 1); 
+    int next_prompt = 0; 
+    int64_t n_prompt_tokens = 0; 
+    int64_t n_reused_prompt_tokens = 0; 
+    int64_t n_generated = 0; 
+    int n_decode_calls = 0; 
+    int n_steps = 0; 
+    int64_t n_drafted = 0; 
+    int64_t n_accepted = 0; 
+    double busy_slot_steps = 0.0; 
+    double batch_fill_sum = 0.0; 
+    // llama_perf_context files every multi-token batch under prompt eval, so mixed steps are
+    // timed here: each decode is synchronized and its time split by prompt/generated tokens.
+    double t_prefill_ms = 0.0; 
+    double t_decode_ms = 0.0; 
+    double t_sample_ms = 0.0; 
+    double t_detokenize_ms = 0.0; 
+    double t_draft_ms = 0.0; 
+    auto release_slot = [&](Slot& S) { 
+        if (S.smpl) common_sampler_free(S.smpl); 
+        S.smpl = nullptr; 
+        S.client = -1; 
+        S.prompt_tokens.clear(); 
+        S.n_past = 0; 
+        S.n_discarded = 0; 
+        S.i_batch = -1; 
+        S.n_generated = 0; 
+        S.stop = stop_matcher(); 
+    }; 
+    context_state& state = get_context_state(ctx); 
+    auto cache_of = [&](const Slot& S) -> std::vector<llama_token>& { return state.seq_tokens[S.seq_id]; }; 
+    // With prompt lookup, each generating slot may add drafts behind its token; together they
+    // must still fit one batch.
+    const int n_draft_max = std::max(0, std::min(state.lookup_n_draft, n_batch / n_slots - 1)); 
+    const size_t n_ctx_seq = context_seq_size(ctx); 
+    int n_context_shifts = 0; 
+    try { 
+        // Tokenize the first wave of prompts up front; the rest are tokenized on admission.
+        const int n_wave = std::min(n_slots, std::max(n_prompts, 0)); 
+        std::vector<std::vector<llama_token>> wave(n_wave); 
+        for (int i = 0; i < n_wave; ++i) wave[i] = helper_tokenize(model, std::string(prompts[i]), true); 
+        // Decode the prefix shared by the first wave once into slot 0, then fork it to the other
+        // slots with llama_kv_self_seq_cp instead of recomputing it for every sequence.
+        if (n_wave > 1) { 
+            size_t n_shared = wave[0].size(); 
+            for (int i = 1; i < n_wave; ++i) n_shared = std::min(n_shared, common_prefix_length(wave[0], wave[i].data(), wave[i].size())); 
+            for (const auto& toks : wave) if (!toks.empty()) n_shared = std::min(n_shared, toks.size() - 1); 
+            if (n_shared >= min_shared_prefix) { 
+                const std::vector<llama_token> prefix(wave[0].begin(), wave[0].begin() + n_shared); 
+                std::vector<llama_token>& cached0 = cache_of(slots[0]); 
+                const size_t n_have = reuse_cached_prefix(ctx, slots[0].seq_id, cached0, prefix.data(), prefix.size(), false); 
+                n_prompt_tokens += prefix.size() - n_have; 
+                const auto t0 = std::chrono::steady_clock::now(); 
+                prefill_sequence(ctx, batch, slots[0].seq_id, cached0, prefix, n_have); 
+                llama_synchronize(ctx); 
+                t_prefill_ms += elapsed_ms(t0); 
+                n_decode_calls += (int)((prefix.size() - n_have + n_batch - 1) / n_batch); 
+                batch_fill_sum += (double)(prefix.size() - n_have) / n_batch; 
+                for (int s = 1; s < n_slots; ++s) { 
+                    std::vector<llama_token>& cached = cache_of(slots[s]); 
+                    if (common_prefix_length(cached, prefix.data(), prefix.size()) == prefix.size()) continue; 
+                    llama_kv_self_seq_rm(ctx, slots[s].seq_id, -1, -1); 
+                    llama_kv_self_seq_cp(ctx, slots[0].seq_id, slots[s].seq_id, -1, -1); 
+                    cached = prefix; 
+                } 
+            } 
+        } 
+        while (true) { 
+            if (cancel && *cancel) { 
+                for (auto& S : slots) release_slot(S); 
+                break; 
+            } 
+            // Admit pending prompts, each into the free slot whose cached tokens share the
+            // longest prefix with it. Only the tokens after that prefix are prefilled.
+            while (next_prompt < n_prompts) { 
+                if (std::none_of(slots.begin(), slots.end(), [](const Slot& S) { return S.client < 0; })) break; 
+                const int id = next_prompt++; 
+                std::vector<llama_token> toks = id < n_wave ? std::move(wave[id]) : helper_tokenize(model, std::string(prompts[id]), true); 
+                if (toks.empty()) continue; 
+                Slot* best = nullptr; 
+                size_t best_common = 0; 
+                for (auto& S : slots) { 
+                    if (S.client >= 0) continue; 
+                    const size_t n_common = common_prefix_length(cache_of(S), toks.data(), toks.size()); 
+                    if (!best || n_common > best_common) { best = &S; best_common = n_common; } 
+                } 
+                Slot& S = *best; 
+                S.n_past = (llama_pos)reuse_cached_prefix(ctx, S.seq_id, cache_of(S), toks.data(), toks.size()); 
+                n_reused_prompt_tokens += S.n_past; 
+                S.smpl = common_sampler_init(model, sampling_of(id)); 
+                if (!S.smpl) throw std::runtime_error("Sampler init failed for client " + std::to_string(id)); 
+                S.client = id; 
+                S.prompt_tokens = std::move(toks); 
+                S.stop = stop_matcher(params_of(id)); 
+            } 
+            // Decode tokens of running sequences go first. Prompts are then prefilled in chunks
+            // from the remaining budget: while other sequences are decoding the step is held to
+            // about one ubatch so their per-token latency stays flat during a long prefill.
+            common_batch_clear(batch); 
+            int n_busy = 0; 
+            for (auto& S : slots) { 
+                S.i_batch = -1; 
+                S.drafts.clear(); 
+                if (S.client < 0 || !S.prefilled()) continue; 
+                if (state.ctx_shift) { 
+                    // Room for the sampled token and its drafts; a slot that cannot shift ends.
+                    const size_t n_keep = state.n_keep < 0 ? S.prompt_tokens.size() : (size_t)state.n_keep; 
+                    const size_t n_discard = context_shift_size(cache_of(S).size(), 1 + (size_t)n_draft_max, n_ctx_seq, n_keep); 
+                    if (n_discard == std::string::npos) { 
+                        release_slot(S); 
+                        continue; 
+                    } 
+                    if (n_discard > 0) { 
+                        const size_t n_before = cache_of(S).size(); 
+                        context_shift(ctx, S.seq_id, cache_of(S), n_keep, n_discard); 
+                        S.n_past -= (llama_pos)(n_before - cache_of(S).size()); 
+                        S.n_discarded += (llama_pos)(n_before - cache_of(S).size()); 
+                        n_context_shifts++; 
+                    } 
+                } 
+                common_batch_add(batch, S.sampled, S.n_past++, {S.seq_id}, true); 
+                cache_of(S).push_back(S.sampled); 
+                S.i_batch = batch.n_tokens - 1; 
+                if (n_draft_max > 0) { 
+                    auto t0 = std::chrono::steady_clock::now(); 
+                    lookup_draft(cache_of(S), state.lookup_ngram_max, n_draft_max, S.drafts); 
+                    t_draft_ms += elapsed_ms(t0); 
+                    for (llama_token d : S.drafts) { 
+                        common_batch_add(batch, d, S.n_past++, {S.seq_id}, true); 
+                        cache_of(S).push_back(d); 
+                    } 
+                    n_drafted += (int64_t)S.drafts.size(); 
+                } 
+                n_busy++; 
+            } 
+            const int n_decode = batch.n_tokens; 
+            int prefill_budget = n_decode == 0 ? n_batch : std::min(n_batch - n_decode, std::max(n_ubatch - n_decode, n_ubatch / 4)); 
+            for (auto& S : slots) { 
+                if (S.client < 0 || S.prefilled() || prefill_budget <= 0) continue; 
+                const int n_chunk = std::min<int>(prefill_budget, (int)S.prompt_tokens.size() - S.n_past); 
+                for (int k = 0; k < n_chunk; ++k, ++S.n_past) { 
+                    common_batch_add(batch, S.prompt_tokens[S.n_past], S.n_past, {S.seq_id}, false); 
+                    cache_of(S).push_back(S.prompt_tokens[S.n_past]); 
+                } 
+                prefill_budget -= n_chunk; 
+                n_prompt_tokens += n_chunk; 
+                if (S.prefilled()) { 
+                    batch.logits[batch.n_tokens - 1] = true; 
+                    S.i_batch = batch.n_tokens - 1; 
+                } 
+                n_busy++; 
+            } 
+            if (batch.n_tokens == 0) break; 
+            auto t0 = std::chrono::steady_clock::now(); 
+            if (llama_decode(ctx, batch) != 0) { 
+                throw std::runtime_error("Parallel generation decoding failed."); 
+            } 
+            llama_synchronize(ctx); 
+            const double t_step_ms = elapsed_ms(t0); 
+            t_decode_ms += t_step_ms * n_decode / batch.n_tokens; 
+            t_prefill_ms += t_step_ms * (batch.n_tokens - n_decode) / batch.n_tokens; 
+            n_decode_calls++; 
+            n_steps++; 
+            busy_slot_steps += (double)n_busy / n_slots; 
+            batch_fill_sum += (double)batch.n_tokens / n_batch; 
+            for (auto& S : slots) { 
+                if (S.i_batch < 0) continue; 
+                // Sample at the slot's first row, then keep walking its drafts while they match.
+                std::string& response = responses[S.client]; 
+                size_t n_ok = 0; 
+                bool done = false; 
+                llama_token tok; 
+                while (true) { 
+                    t0 = std::chrono::steady_clock::now(); 
+                    tok = common_sampler_sample(S.smpl, ctx, S.i_batch + (int32_t)n_ok); 
+                    common_sampler_accept(S.smpl, tok, true); 
+                    t_sample_ms += elapsed_ms(t0); 
+                    if (tok == eos_token || llama_vocab_is_eog(vocab, tok)) { 
+                        done = true; 
+                        break; 
+                    } 
+                    if (probs && (*probs)[S.client].n_probs > 0) (*probs)[S.client].add(llama_get_logits_ith(ctx, S.i_batch + (int32_t)n_ok), llama_vocab_n_tokens(vocab), tok); 
+                    t0 = std::chrono::steady_clock::now(); 
+                    const size_t n_old = response.size(); 
+                    token_piece_append(vocab, tok, response); 
+                    t_detokenize_ms += elapsed_ms(t0); 
+                    n_generated++; 
+                    // A spent token budget or a stop string frees the slot now rather than after
+                    // one more decode step.
+                    const int max_tokens = params_of(S.client).max_tokens; 
+                    const size_t stop_pos = S.stop.find(response, n_old); 
+                    if (stop_pos != std::string::npos) response.resize(stop_pos); 
+                    if (stop_pos != std::string::npos || (max_tokens > 0 && ++S.n_generated >= max_tokens)) { 
+                        done = true; 
+                        break; 
+                    } 
+                    if (n_ok == S.drafts.size() || tok != S.drafts[n_ok]) break; 
+                    n_ok++; 
+                } 
+                n_accepted += (int64_t)n_ok; 
+                // Rejected drafts leave the KV cache, which then matches the accepted tokens again.
+                const size_t n_rejected = S.drafts.size() - n_ok; 
+                if (n_rejected > 0) { 
+                    S.n_past -= (llama_pos)n_rejected; 
+                    cache_of(S).resize(cache_of(S).size() - n_rejected); 
+                    if (!llama_kv_self_seq_rm(ctx, S.seq_id, S.n_past, -1)) { 
+                        throw std::runtime_error("Prompt lookup needs a KV cache that supports partial removal."); 
+                    } 
+                } 
+                if (done) { 
+                    release_slot(S); 
+                } else { 
+                    S.sampled = tok; 
+                } 
+            } 
+        } 
+    } catch (const std::exception& e) { 
+        // The KV contents of the slots are unknown after a failed decode; forget them.
+        for (auto& S : slots) { 
+            release_slot(S); 
+            llama_kv_self_seq_rm(ctx, S.seq_id, -1, -1); 
+            cache_of(S).clear(); 
+        } 
+        llama_batch_free(batch); 
+        throw; 
+    } 
+    llama_batch_free(batch); 
+    if (stats_out) { 
+        const double t_ms = elapsed_ms(t_start); 
+        *stats_out = {}; 
+        stats_out->n_slots = n_slots; 
+        stats_out->n_prompts = n_prompts; 
+        stats_out->n_prompt_tokens = n_prompt_tokens; 
+        stats_out->n_reused_prompt_tokens = n_reused_prompt_tokens; 
+        stats_out->n_generated_tokens = n_generated; 
+        stats_out->n_decode_calls = n_decode_calls; 
+        stats_out->t_total_ms = t_ms; 
+        stats_out->t_prefill_ms = t_prefill_ms; 
+        stats_out->t_decode_ms = t_decode_ms; 
+        stats_out->t_sample_ms = t_sample_ms; 
+        stats_out->t_detokenize_ms = t_detokenize_ms; 
+        stats_out->tokens_per_second = t_ms > 0.0 ? (n_prompt_tokens + n_generated) * 1000.0 / t_ms : 0.0; 
+        stats_out->avg_batch_fill = n_decode_calls > 0 ? batch_fill_sum / n_decode_calls : 0.0; 
+        stats_out->avg_slot_occupancy = n_steps > 0 ? busy_slot_steps / n_steps : 0.0; 
+        stats_out->n_kv_cells_used = llama_kv_self_used_cells(ctx); 
+        stats_out->n_drafted_tokens = n_drafted; 
+        stats_out->n_accepted_tokens = n_accepted; 
+        stats_out->t_draft_ms = t_draft_ms; 
+        stats_out->n_context_shifts = n_context_shifts; 
+    } 
+} 
+
+static char** string_array_to_c(const std::vector<std::string>& strings) { 
+    char** arr = new char*[strings.size()]; 
+    for (size_t i = 0; i < strings.size(); ++i) arr[i] = string_to_c_str(strings[i]); 
+    return arr; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate_parallel_ext(newrllama_context_handle ctx, const char** prompts, int n_prompts, const struct newrllama_sampling_params* params, int n_params, char*** results_out, struct newrllama_perf_stats* stats_out, const char** error_message) { 
+    if (!ctx || !params) { 
+        set_error(error_message, "Context or params handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    std::vector<std::string> responses; 
+    try { 
+        const std::vector<newrllama_sampling_params> p = read_params(params, n_params); 
+        generate_parallel_impl(ctx, prompts, n_prompts, p.data(), n_params, nullptr, responses, stats_out); 
+    } catch (const std::exception& e) { 
+        set_error(error_message, e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    *results_out = string_array_to_c(responses); 
     return NEWRLLAMA_SUCCESS; 
-}
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate_parallel(newrllama_context_handle ctx, const char** prompts, int n_prompts, const struct newrllama_parallel_params* params, char*** results_out, const char** error_message) { 
+    const newrllama_sampling_params p = params ? legacy_params(*params) : newrllama_sampling_default_params(); 
+    return newrllama_generate_parallel_ext(ctx, prompts, n_prompts, params ? &p : nullptr, 1, results_out, nullptr, error_message); 
+} 
+
+// Output of newrllama_score, laid out as struct newrllama_scores.
+struct score_result { 
+    std::vector<double> logprob;        // per pair
+    std::vector<int64_t> offsets;       // n_pairs + 1, into token / token_logprob
+    std::vector<int32_t> token;         // continuation tokens of all pairs
+    std::vector<float> token_logprob; 
+}; 
+
+// An asynchronous generation: the work runs on its own thread and publishes its outcome under
+// `mutex`. Jobs on the same context queue on the context's run_mutex.
+struct newrllama_job { 
+    std::thread worker; 
+    std::mutex mutex; 
+    std::condition_variable finished; 
+    newrllama_job_state state = NEWRLLAMA_JOB_RUNNING; 
+    std::atomic<bool> cancel{false}; 
+    std::vector<std::string> results; 
+    std::vector<token_probs> probs;   // per result, when the params asked for n_probs
+    score_result scores;              // newrllama_score_async
+    newrllama_perf_stats stats{}; 
+    std::string error; 
+}; 
+
+// Starts `work` on the job's thread; `work` fills job->results and job->stats. The contexts
+// `work` uses are held until it returns.
+template <typename Work> 
+static newrllama_job* job_start(Work work, const std::vector<const llama_context*>& contexts = {}) { 
+    std::unique_ptr<newrllama_job> owned(new newrllama_job()); 
+    newrllama_job* job = owned.get(); 
+    for (const llama_context* ctx : contexts) context_hold(ctx); 
+    try { 
+        job->worker = std::thread([job, work, contexts]() { 
+            newrllama_job_state state = NEWRLLAMA_JOB_DONE; 
+            try { 
+                work(job); 
+                if (job->cancel) state = NEWRLLAMA_JOB_CANCELLED; 
+            } catch (const std::exception& e) { 
+                job->error = e.what(); 
+                state = NEWRLLAMA_JOB_FAILED; 
+            } 
+            for (const llama_context* ctx : contexts) context_unhold(ctx); 
+            std::lock_guard<std::mutex> lock(job->mutex); 
+            job->state = state; 
+            job->finished.notify_all(); 
+        }); 
+    } catch (...) { 
+        for (const llama_context* ctx : contexts) context_unhold(ctx); 
+        throw; 
+    } 
+    return owned.release(); 
+} 
+
+
+// Sampling settings owned by a job: the caller's strings (grammar and stop strings) are copied
+// so they outlive the call that queued the job.
+struct job_params { 
+    newrllama_sampling_params params; 
+    std::string grammar; 
+    std::vector<std::string> stop; 
+    mutable std::vector<const char*> stop_ptrs;   // rebuilt by get(), as copies of a job_params move
+    explicit job_params(const newrllama_sampling_params& p) : params(p), grammar(p.grammar ? p.grammar : "") { 
+        for (int i = 0; p.stop && i < p.n_stop; ++i) stop.emplace_back(p.stop[i] ? p.stop[i] : ""); 
+    } 
+    newrllama_sampling_params get() const { 
+        newrllama_sampling_params p = params; 
+        p.grammar = grammar.c_str(); 
+        stop_ptrs.clear(); 
+        for (const auto& s : stop) stop_ptrs.push_back(s.c_str()); 
+        p.stop = stop_ptrs.data(); 
+        p.n_stop = (int)stop_ptrs.size(); 
+        return p; 
+    } 
+}; 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate_async(newrllama_context_handle ctx, const int32_t* tokens_in, size_t n_tokens_in, int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, newrllama_job_handle* job_out, const char** error_message) { 
+    if (!ctx || !job_out) { 
+        set_error(error_message, "Context or job handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const newrllama_sampling_params params = sampling_params(max_tokens, top_k, top_p, temperature, repeat_last_n, penalty_repeat, seed); 
+    const std::vector<int32_t> tokens(tokens_in, tokens_in + n_tokens_in); 
+    try { 
+        *job_out = job_start([ctx, params, tokens](newrllama_job* job) { 
+            job->results.assign(1, generate_single(ctx, 0, tokens.data(), tokens.size(), params, nullptr, nullptr, &job->stats, &job->cancel)); 
+        }, {ctx}); 
+    } catch (const std::exception& e) { 
+        set_error(error_message, std::string("Failed to start generation job: ") + e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate_ext_async(newrllama_context_handle ctx, const int32_t* tokens_in, size_t n_tokens_in, const struct newrllama_sampling_params* params, newrllama_job_handle* job_out, const char** error_message) { 
+    if (!ctx || !params || !job_out) { 
+        set_error(error_message, "Context, params or job handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const std::vector<int32_t> tokens(tokens_in, tokens_in + n_tokens_in); 
+    try { 
+        const job_params params_copy(read_params(params)); 
+        *job_out = job_start([ctx, params_copy, tokens](newrllama_job* job) { 
+            job->probs.resize(1); 
+            job->results.assign(1, generate_single(ctx, 0, tokens.data(), tokens.size(), params_copy.get(), nullptr, nullptr, &job->stats, &job->cancel, &job->probs[0])); 
+        }, {ctx}); 
+    } catch (const std::exception& e) { 
+        set_error(error_message, std::string("Failed to start generation job: ") + e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate_parallel_ext_async(newrllama_context_handle ctx, const char** prompts, int n_prompts, const struct newrllama_sampling_params* params, int n_params, newrllama_job_handle* job_out, const char** error_message) { 
+    if (!ctx || !params || !job_out) { 
+        set_error(error_message, "Context, params or job handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const std::vector<std::string> prompt_copies(prompts, prompts + std::max(n_prompts, 0)); 
+    try { 
+        const std::vector<newrllama_sampling_params> params_in = read_params(params, n_params); 
+        const std::vector<job_params> params_copies(params_in.begin(), params_in.end()); 
+        *job_out = job_start([ctx, params_copies, prompt_copies](newrllama_job* job) { 
+            std::vector<const char*> prompt_ptrs; 
+            for (const auto& prompt : prompt_copies) prompt_ptrs.push_back(prompt.c_str()); 
+            std::vector<newrllama_sampling_params> p; 
+            for (const auto& copy : params_copies) p.push_back(copy.get()); 
+            generate_parallel_impl(ctx, prompt_ptrs.data(), (int)prompt_ptrs.size(), p.data(), (int)p.size(), &job->cancel, job->results, &job->stats, &job->probs); 
+        }, {ctx}); 
+    } catch (const std::exception& e) { 
+        set_error(error_message, std::string("Failed to start generation job: ") + e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate_parallel_async(newrllama_context_handle ctx, const char** prompts, int n_prompts, const struct newrllama_parallel_params* params, newrllama_job_handle* job_out, const char** error_message) { 
+    const newrllama_sampling_params p = params ? legacy_params(*params) : newrllama_sampling_default_params(); 
+    return newrllama_generate_parallel_ext_async(ctx, prompts, n_prompts, params ? &p : nullptr, 1, job_out, error_message); 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate_speculative_async(newrllama_context_handle ctx, newrllama_context_handle draft_ctx, const int32_t* tokens_in, size_t n_tokens_in, const struct newrllama_sampling_params* params, int n_draft, newrllama_job_handle* job_out, const char** error_message) { 
+    if (!ctx || !draft_ctx || !params || !job_out) { 
+        set_error(error_message, "Context, draft context, params or job handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (ctx == draft_ctx) { 
+        set_error(error_message, "The draft context must differ from the target context."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const std::vector<int32_t> tokens(tokens_in, tokens_in + n_tokens_in); 
+    try { 
+        const job_params params_copy(read_params(params)); 
+        *job_out = job_start([ctx, draft_ctx, params_copy, n_draft, tokens](newrllama_job* job) { 
+            const newrllama_sampling_params p = params_copy.get(); 
+            job->probs.assign(1, token_probs()); 
+            job->probs[0].n_probs = p.n_probs; 
+            job->results.assign(1, generate_speculative(ctx, draft_ctx, 0, tokens.data(), tokens.size(), p, n_draft, nullptr, nullptr, &job->stats, &job->cancel, p.n_probs > 0 ? &job->probs[0] : nullptr)); 
+        }, {ctx, draft_ctx}); 
+    } catch (const std::exception& e) { 
+        set_error(error_message, std::string("Failed to start generation job: ") + e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_job_state newrllama_job_status(newrllama_job_handle job) { 
+    if (!job) return NEWRLLAMA_JOB_FAILED; 
+    std::lock_guard<std::mutex> lock(job->mutex); 
+    return job->state; 
+} 
+
+NEWRLLAMA_API newrllama_job_state newrllama_job_wait(newrllama_job_handle job, int timeout_ms) { 
+    if (!job) return NEWRLLAMA_JOB_FAILED; 
+    std::unique_lock<std::mutex> lock(job->mutex); 
+    auto done = [job]() { return job->state != NEWRLLAMA_JOB_RUNNING; }; 
+    if (timeout_ms < 0) { 
+        job->finished.wait(lock, done); 
+    } else { 
+        job->finished.wait_for(lock, std::chrono::milliseconds(timeout_ms), done); 
+    } 
+    return job->state; 
+} 
+
+NEWRLLAMA_API void newrllama_job_cancel(newrllama_job_handle job) { 
+    if (job) job->cancel = true; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_job_result(newrllama_job_handle job, char*** results_out, int* n_results_out, struct newrllama_perf_stats* stats_out, const char** error_message) { 
+    if (!job) { 
+        set_error(error_message, "Job handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    std::lock_guard<std::mutex> lock(job->mutex); 
+    if (job->state == NEWRLLAMA_JOB_RUNNING) { 
+        set_error(error_message, "Job is still running."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (job->state == NEWRLLAMA_JOB_FAILED) { 
+        set_error(error_message, job->error); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    *results_out = string_array_to_c(job->results); 
+    *n_results_out = (int)job->results.size(); 
+    if (stats_out) *stats_out = job->stats; 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_job_result_arena(newrllama_job_handle job, char** text_out, int64_t** offsets_out, int* n_results_out, struct newrllama_perf_stats* stats_out, const char** error_message) { 
+    if (!job || !text_out || !offsets_out || !n_results_out) { 
+        set_error(error_message, "Job handle or output pointer is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    std::lock_guard<std::mutex> lock(job->mutex); 
+    if (job->state == NEWRLLAMA_JOB_RUNNING) { 
+        set_error(error_message, "Job is still running."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (job->state == NEWRLLAMA_JOB_FAILED) { 
+        set_error(error_message, job->error); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const size_t n_results = job->results.size(); 
+    int64_t* offsets = new int64_t[n_results + 1]; 
+    offsets[0] = 0; 
+    for (size_t i = 0; i < n_results; ++i) offsets[i + 1] = offsets[i] + (int64_t)job->results[i].size(); 
+    char* text = new char[(size_t)offsets[n_results] + 1]; 
+    for (size_t i = 0; i < n_results; ++i) std::memcpy(text + offsets[i], job->results[i].data(), job->results[i].size()); 
+    text[offsets[n_results]] = '\0'; 
+    *text_out = text; 
+    *offsets_out = offsets; 
+    *n_results_out = (int)n_results; 
+    if (stats_out) *stats_out = job->stats; 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_job_token_probs(newrllama_job_handle job, int index, struct newrllama_token_probs* probs_out, const char** error_message) { 
+    if (!job || !probs_out) { 
+        set_error(error_message, "Job handle or output pointer is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    std::lock_guard<std::mutex> lock(job->mutex); 
+    if (job->state == NEWRLLAMA_JOB_RUNNING) { 
+        set_error(error_message, "Job is still running."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (job->state == NEWRLLAMA_JOB_FAILED) { 
+        set_error(error_message, job->error); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (index < 0 || (size_t)index >= job->results.size()) { 
+        set_error(error_message, "Result index is out of range."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    token_probs_to_c((size_t)index < job->probs.size() ? job->probs[index] : token_probs(), probs_out); 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API void newrllama_free_token_probs(struct newrllama_token_probs* probs) { 
+    if (!probs) return; 
+    delete[] probs->token; 
+    delete[] probs->logprob; 
+    delete[] probs->top_token; 
+    delete[] probs->top_logprob; 
+    *probs = {}; 
+} 
+
+NEWRLLAMA_API void newrllama_job_free(newrllama_job_handle job) { 
+    if (!job) return; 
+    job->cancel = true; 
+    if (job->worker.joinable()) job->worker.join(); 
+    delete job; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_generate_seq(newrllama_context_handle ctx, int32_t seq_id, const int32_t* tokens_in, size_t n_tokens_in, int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, char** result_out, struct newrllama_perf_stats* stats_out, const char** error_message) { 
+    if (!ctx) { 
+        set_error(error_message, "Context handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (seq_id < 0 || (uint32_t)seq_id >= llama_n_seq_max(ctx)) { 
+        set_error(error_message, "Sequence id is outside the context's n_seq_max."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const newrllama_sampling_params params = sampling_params(max_tokens, top_k, top_p, temperature, repeat_last_n, penalty_repeat, seed); 
+    try { 
+        *result_out = string_to_c_str(generate_single(ctx, seq_id, tokens_in, n_tokens_in, params, nullptr, nullptr, stats_out)); 
+        return NEWRLLAMA_SUCCESS; 
+    } catch (const std::exception& e) { 
+        set_error(error_message, e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+} 
+
+// A fixed set of contexts whose sequences are leased out one request at a time. Waiters queue
+// by ticket so leases are granted in arrival order.
+struct newrllama_pool { 
+    std::vector<llama_context*> contexts; 
+    std::vector<std::vector<bool>> leased;   // [context][sequence]
+    std::vector<int> n_busy;                 // leased sequences per context
+    int n_leases = 0; 
+    int n_leased = 0; 
+    std::deque<uint64_t> waiters; 
+    uint64_t next_ticket = 0; 
+    bool closing = false; 
+    std::mutex mutex; 
+    std::condition_variable changed; 
+}; 
+
+// Waits for a free sequence in ticket order. Returns false if `cancel` is set while waiting;
+// an expired timeout or a pool being freed throws. Either way the place in the queue is given up.
+static bool pool_lease(newrllama_pool* pool, int timeout_ms, const std::atomic<bool>* cancel, llama_context** ctx_out, llama_seq_id* seq_out) { 
+    const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::max(timeout_ms, 0)); 
+    std::unique_lock<std::mutex> lock(pool->mutex); 
+    const uint64_t ticket = pool->next_ticket++; 
+    pool->waiters.push_back(ticket); 
+    auto leave_queue = [&]() { 
+        pool->waiters.erase(std::find(pool->waiters.begin(), pool->waiters.end(), ticket)); 
+        pool->changed.notify_all(); 
+    }; 
+    auto give_up = [&](const char* msg) { 
+        leave_queue(); 
+        throw std::runtime_error(msg); 
+    }; 
+    while (!pool->closing && !(pool->waiters.front() == ticket && pool->n_leased < pool->n_leases)) { 
+        if (cancel && *cancel) { 
+            leave_queue(); 
+            return false; 
+        } 
+        // Cancellable waits wake periodically to look at the flag.
+        auto until = cancel ? std::chrono::steady_clock::now() + std::chrono::milliseconds(50) : deadline; 
+        if (timeout_ms >= 0 && until > deadline) until = deadline; 
+        if (timeout_ms < 0 && !cancel) { 
+            pool->changed.wait(lock); 
+        } else if (pool->changed.wait_until(lock, until) == std::cv_status::timeout && timeout_ms >= 0 && std::chrono::steady_clock::now() >= deadline) { 
+            give_up("Timed out waiting for a free pool sequence."); 
+        } 
+    } 
+    if (pool->closing) give_up("Context pool is being freed."); 
+    pool->waiters.pop_front(); 
+    size_t best = 0; 
+    for (size_t i = 1; i < pool->contexts.size(); ++i) { 
+        if (pool->n_busy[i] < pool->n_busy[best]) best = i; 
+    } 
+    std::vector<bool>& slots = pool->leased[best]; 
+    const size_t seq = std::find(slots.begin(), slots.end(), false) - slots.begin(); 
+    slots[seq] = true; 
+    pool->n_busy[best]++; 
+    pool->n_leased++; 
+    pool->changed.notify_all(); 
+    *ctx_out = pool->contexts[best]; 
+    *seq_out = (llama_seq_id)seq; 
+    return true; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_pool_create(newrllama_model_handle model, int n_contexts, const struct newrllama_context_params* params, newrllama_pool_handle* pool_out, const char** error_message) { 
+    if (!model || !params || !pool_out || n_contexts < 1) { 
+        set_error(error_message, "Invalid model handle, context params or pool size."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (!context_params_size_ok(params)) { 
+        set_error(error_message, "params->struct_size is too small; start from newrllama_context_default_params()."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    newrllama_context_params ctx_params = newrllama_context_default_params(); 
+    std::memcpy(&ctx_params, params, std::min(params->struct_size, sizeof(ctx_params))); 
+    ctx_params.struct_size = sizeof(ctx_params); 
+    ctx_params.embeddings = false; 
+    std::unique_ptr<newrllama_pool> pool(new newrllama_pool()); 
+    for (int i = 0; i < n_contexts; ++i) { 
+        newrllama_context_handle ctx = nullptr; 
+        if (newrllama_context_create_ext(model, &ctx_params, &ctx, error_message) != NEWRLLAMA_SUCCESS) { 
+            for (llama_context* created : pool->contexts) newrllama_context_free(created); 
+            return NEWRLLAMA_ERROR; 
+        } 
+        pool->contexts.push_back(ctx); 
+        pool->leased.emplace_back(llama_n_seq_max(ctx), false); 
+        pool->n_busy.push_back(0); 
+        pool->n_leases += (int)llama_n_seq_max(ctx); 
+    } 
+    *pool_out = pool.release(); 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API void newrllama_pool_free(newrllama_pool_handle pool) { 
+    if (!pool) return; 
+    { 
+        std::unique_lock<std::mutex> lock(pool->mutex); 
+        pool->closing = true; 
+        pool->changed.notify_all(); 
+        pool->changed.wait(lock, [pool]() { return pool->n_leased == 0 && pool->waiters.empty(); }); 
+    } 
+    for (llama_context* ctx : pool->contexts) newrllama_context_free(ctx); 
+    delete pool; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_pool_acquire(newrllama_pool_handle pool, int timeout_ms, newrllama_context_handle* ctx_out, int32_t* seq_id_out, const char** error_message) { 
+    if (!pool || !ctx_out || !seq_id_out) { 
+        set_error(error_message, "Pool handle or output pointer is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    try { 
+        pool_lease(pool, timeout_ms, nullptr, ctx_out, seq_id_out); 
+        return NEWRLLAMA_SUCCESS; 
+    } catch (const std::exception& e) { 
+        set_error(error_message, e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+} 
+
+NEWRLLAMA_API void newrllama_pool_release(newrllama_pool_handle pool, newrllama_context_handle ctx, int32_t seq_id) { 
+    if (!pool || !ctx) return; 
+    const size_t i = std::find(pool->contexts.begin(), pool->contexts.end(), ctx) - pool->contexts.begin(); 
+    if (i == pool->contexts.size() || seq_id < 0 || (size_t)seq_id >= pool->leased[i].size()) return; 
+    { 
+        // Another lease of this context may be decoding; reset the sequence between its steps.
+        context_state& state = get_context_state(ctx); 
+        std::lock_guard<std::mutex> run_lock(state.run_mutex); 
+        llama_kv_self_seq_rm(ctx, seq_id, -1, -1); 
+        state.seq_tokens[seq_id].clear(); 
+    } 
+    std::lock_guard<std::mutex> lock(pool->mutex); 
+    if (!pool->leased[i][seq_id]) return; 
+    pool->leased[i][seq_id] = false; 
+    pool->n_busy[i]--; 
+    pool->n_leased--; 
+    pool->changed.notify_all(); 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_pool_generate_async(newrllama_pool_handle pool, const int32_t* tokens_in, size_t n_tokens_in, int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, newrllama_job_handle* job_out, const char** error_message) { 
+    if (!pool || !job_out) { 
+        set_error(error_message, "Pool or job handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const newrllama_sampling_params params = sampling_params(max_tokens, top_k, top_p, temperature, repeat_last_n, penalty_repeat, seed); 
+    const std::vector<int32_t> tokens(tokens_in, tokens_in + n_tokens_in); 
+    try { 
+        *job_out = job_start([pool, params, tokens](newrllama_job* job) { 
+            llama_context* ctx = nullptr; 
+            llama_seq_id seq = 0; 
+            if (!pool_lease(pool, -1, &job->cancel, &ctx, &seq)) { 
+                job->results.assign(1, std::string()); 
+                return; 
+            } 
+            try { 
+                job->results.assign(1, generate_single(ctx, seq, tokens.data(), tokens.size(), params, nullptr, nullptr, &job->stats, &job->cancel)); 
+            } catch (...) { 
+                newrllama_pool_release(pool, ctx, seq); 
+                throw; 
+            } 
+            newrllama_pool_release(pool, ctx, seq); 
+        }); 
+    } catch (const std::exception& e) { 
+        set_error(error_message, std::string("Failed to start generation job: ") + e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API void newrllama_pool_info(newrllama_pool_handle pool, int* n_leases_out, int* n_busy_out, int* n_waiting_out) { 
+    if (!pool) return; 
+    std::lock_guard<std::mutex> lock(pool->mutex); 
+    if (n_leases_out) *n_leases_out = pool->n_leases; 
+    if (n_busy_out) *n_busy_out = pool->n_leased; 
+    if (n_waiting_out) *n_waiting_out = (int)pool->waiters.size(); 
+} 
+
+// A conversation kept in one sequence of a context. `tokens` is what the sequence holds for
+// it (the formatted turns up to the latest reply) and `formatted` the template text they were
+// made from, so a turn only tokenizes what the template adds after it.
+struct newrllama_chat { 
+    llama_context* ctx = nullptr; 
+    llama_seq_id seq = 0; 
+    std::string tmpl; 
+    bool has_tmpl = false;                 // false: llama_chat_apply_template's default
+    std::vector<std::string> roles; 
+    std::vector<std::string> contents; 
+    size_t n_system = 0;                   // leading messages kept by newrllama_chat_reset
+    std::vector<llama_token> tokens; 
+    std::string formatted; 
+    std::mutex mutex; 
+    std::mutex jobs_mutex; 
+    int n_jobs = 0;                        // async turns in flight, guarded by jobs_mutex
+    std::condition_variable jobs_done; 
+}; 
+
+// Async turns hold their chat like job_start holds contexts; newrllama_chat_free waits for them.
+static void chat_hold(newrllama_chat* chat) { 
+    std::lock_guard<std::mutex> lock(chat->jobs_mutex); 
+    chat->n_jobs++; 
+} 
+
+static void chat_unhold(newrllama_chat* chat) { 
+    std::lock_guard<std::mutex> lock(chat->jobs_mutex); 
+    if (--chat->n_jobs == 0) chat->jobs_done.notify_all(); 
+} 
+
+// One turn: formats the conversation with the new user message and an assistant header,
+// decodes the tokens for the text past `formatted` after the cached ones, and records the
+// reply. The reply's tokens are taken from the KV mirror, so the next turn reuses them as
+// decoded; only the last piece, sampled but never decoded, is tokenized again. After a context
+// shift the mirror is missing older turns and the conversation goes on from what it still holds.
+// If the template rewrites earlier turns the whole conversation is tokenized, and
+// generate_single still reuses the longest cached prefix of it.
+static std::string chat_turn(newrllama_chat* chat, const char* message, const newrllama_sampling_params& params, newrllama_token_callback callback, void* user_data, newrllama_perf_stats* stats, const std::atomic<bool>* cancel) { 
+    std::lock_guard<std::mutex> lock(chat->mutex); 
+    const llama_vocab* vocab = llama_model_get_vocab(llama_get_model(chat->ctx)); 
+    chat->roles.emplace_back("user"); 
+    chat->contents.emplace_back(message); 
+    std::string reply; 
+    std::string full; 
+    std::vector<llama_token> prompt; 
+    sequence_trace trace; 
+    try { 
+        std::vector<llama_chat_message> messages(chat->roles.size()); 
+        for (size_t i = 0; i < messages.size(); ++i) messages[i] = {chat->roles[i].c_str(), chat->contents[i].c_str()}; 
+        full = chat_format(chat->has_tmpl ? chat->tmpl.c_str() : nullptr, messages, true); 
+        if (!chat->tokens.empty() && full.compare(0, chat->formatted.size(), chat->formatted) == 0) { 
+            prompt = chat->tokens; 
+            tokenize_append(vocab, full.c_str() + chat->formatted.size(), false, prompt, true); 
+        } else { 
+            tokenize_append(vocab, full.c_str(), true, prompt, true); 
+        } 
+        reply = generate_single(chat->ctx, chat->seq, prompt.data(), prompt.size(), params, callback, user_data, stats, cancel, nullptr, &trace); 
+    } catch (...) { 
+        chat->roles.pop_back(); 
+        chat->contents.pop_back(); 
+        chat->tokens.clear(); 
+        chat->formatted.clear(); 
+        throw; 
+    } 
+    std::vector<llama_token> cached; 
+    { 
+        context_state& state = get_context_state(chat->ctx); 
+        std::lock_guard<std::mutex> run_lock(state.run_mutex); 
+        cached = state.seq_tokens[chat->seq]; 
+    } 
+    size_t n_covered = 0; 
+    const size_t n_kept = chat_kept_tokens(cached, trace, reply, [vocab](llama_token token, std::string& out) { token_piece_append(vocab, token, out); }, &n_covered); 
+    if (n_kept != std::string::npos) { 
+        chat->tokens.assign(cached.begin(), cached.begin() + n_kept); 
+        tokenize_append(vocab, reply.c_str() + n_covered, false, chat->tokens); 
+        chat->formatted = full + reply; 
+    } else { 
+        chat->tokens.clear(); 
+        chat->formatted.clear(); 
+    } 
+    chat->roles.emplace_back("assistant"); 
+    chat->contents.push_back(reply); 
+    return reply; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_chat_create(newrllama_context_handle ctx, int32_t seq_id, const char* tmpl, const char* system_prompt, newrllama_chat_handle* chat_out, const char** error_message) { 
+    if (!ctx || !chat_out) { 
+        set_error(error_message, "Context or chat handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (seq_id < 0 || (uint32_t)seq_id >= llama_n_seq_max(ctx)) { 
+        set_error(error_message, "Sequence id is outside the context's n_seq_max."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    std::unique_ptr<newrllama_chat> chat(new newrllama_chat()); 
+    chat->ctx = ctx; 
+    chat->seq = seq_id; 
+    if (!tmpl) tmpl = llama_model_chat_template(llama_get_model(ctx), nullptr); 
+    if (tmpl) { 
+        chat->tmpl = tmpl; 
+        chat->has_tmpl = true; 
+    } 
+    if (system_prompt && *system_prompt) { 
+        chat->roles.emplace_back("system"); 
+        chat->contents.emplace_back(system_prompt); 
+        chat->n_system = 1; 
+    } 
+    *chat_out = chat.release(); 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_chat_send(newrllama_chat_handle chat, const char* message, const struct newrllama_sampling_params* params, newrllama_token_callback callback, void* user_data, char** reply_out, struct newrllama_perf_stats* stats_out, const char** error_message) { 
+    if (!chat || !message || !params) { 
+        set_error(error_message, "Chat handle, message or params is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    try { 
+        *reply_out = string_to_c_str(chat_turn(chat, message, read_params(params), callback, user_data, stats_out, nullptr)); 
+        return NEWRLLAMA_SUCCESS; 
+    } catch (const std::exception& e) { 
+        set_error(error_message, e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_chat_send_async(newrllama_chat_handle chat, const char* message, const struct newrllama_sampling_params* params, newrllama_job_handle* job_out, const char** error_message) { 
+    if (!chat || !message || !params || !job_out) { 
+        set_error(error_message, "Chat handle, message, params or job handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const std::string message_copy(message); 
+    chat_hold(chat); 
+    try { 
+        const job_params params_copy(read_params(params)); 
+        *job_out = job_start([chat, params_copy, message_copy](newrllama_job* job) { 
+            struct unhold { newrllama_chat* chat; ~unhold() { chat_unhold(chat); } } hold{chat}; 
+            job->results.assign(1, chat_turn(chat, message_copy.c_str(), params_copy.get(), nullptr, nullptr, &job->stats, &job->cancel)); 
+        }, {chat->ctx}); 
+    } catch (const std::exception& e) { 
+        chat_unhold(chat); 
+        set_error(error_message, std::string("Failed to start generation job: ") + e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_chat_messages(newrllama_chat_handle chat, char*** roles_out, char*** contents_out, int* n_messages_out, const char** error_message) { 
+    if (!chat || !roles_out || !contents_out || !n_messages_out) { 
+        set_error(error_message, "Chat handle or output pointer is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    std::lock_guard<std::mutex> lock(chat->mutex); 
+    *roles_out = string_array_to_c(chat->roles); 
+    *contents_out = string_array_to_c(chat->contents); 
+    *n_messages_out = (int)chat->roles.size(); 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API void newrllama_chat_info(newrllama_chat_handle chat, int* n_messages_out, int* n_tokens_out) { 
+    if (!chat) return; 
+    std::lock_guard<std::mutex> lock(chat->mutex); 
+    if (n_messages_out) *n_messages_out = (int)chat->roles.size(); 
+    if (n_tokens_out) *n_tokens_out = (int)chat->tokens.size(); 
+} 
+
+NEWRLLAMA_API void newrllama_chat_reset(newrllama_chat_handle chat) { 
+    if (!chat) return; 
+    std::lock_guard<std::mutex> lock(chat->mutex); 
+    chat->roles.resize(chat->n_system); 
+    chat->contents.resize(chat->n_system); 
+    chat->tokens.clear(); 
+    chat->formatted.clear(); 
+} 
+
+NEWRLLAMA_API void newrllama_chat_free(newrllama_chat_handle chat) { 
+    if (!chat) return; 
+    { 
+        std::unique_lock<std::mutex> lock(chat->jobs_mutex); 
+        chat->jobs_done.wait(lock, [chat]() { return chat->n_jobs == 0; }); 
+    } 
+    delete chat; 
+} 
+
+// Embeds tokenized texts into `out` (row-major, one row of n_embd floats per text). Texts are
+// packed into multi-sequence batches of min(n_batch, n_ubatch) tokens over the sequences that
+// hold no tokens (the last sequence if all of them do), as score_impl picks its sequences;
+// non-causal models need a whole sequence inside one ubatch. If the context has no pooling,
+// token embeddings are mean-pooled here.
+static void embed_sequences(llama_context* ctx, const std::vector<std::vector<llama_token>>& texts, bool normalize, float* out) { 
+    const llama_model* model = llama_get_model(ctx); 
+    const int n_embd = llama_model_n_embd(model); 
+    const int n_cap = (int)std::min(llama_n_batch(ctx), llama_n_ubatch(ctx)); 
+    const int n_seq_max = (int)llama_n_seq_max(ctx); 
+    const bool use_encode = llama_model_has_encoder(model) && !llama_model_has_decoder(model); 
+    const bool pooled = llama_pooling_type(ctx) != LLAMA_POOLING_TYPE_NONE; 
+    context_state& state = get_context_state(ctx); 
+    std::lock_guard<std::mutex> run_lock(state.run_mutex); 
+    for (size_t i = 0; i < texts.size(); ++i) { 
+        if (texts[i].empty()) throw std::runtime_error("Text " + std::to_string(i) + " produced no tokens."); 
+        if ((int)texts[i].size() > n_cap) { 
+            throw std::runtime_error("Text " + std::to_string(i) + " has " + std::to_string(texts[i].size()) + " tokens, more than the context's batch size (" + std::to_string(n_cap) + ")."); 
+        } 
+    } 
+    std::vector<llama_seq_id> embed_seqs; 
+    for (int s = 0; s < n_seq_max; ++s) { 
+        if (state.seq_tokens[s].empty()) embed_seqs.push_back(s); 
+    } 
+    if (embed_seqs.empty()) embed_seqs.push_back(n_seq_max - 1); 
+    llama_batch batch = llama_batch_init(n_cap, 0, 1); 
+    llama_set_embeddings(ctx, true); 
+    auto restore = [&]() { 
+        llama_batch_free(batch); 
+        if (!state.embeddings) llama_set_embeddings(ctx, false); 
+    }; 
+    try { 
+        size_t first = 0; 
+        while (first < texts.size()) { 
+            common_batch_clear(batch); 
+            size_t last = first; 
+            while (last < texts.size() && last - first < embed_seqs.size() && batch.n_tokens + (int)texts[last].size() <= n_cap) { 
+                const llama_seq_id seq = embed_seqs[last - first]; 
+                for (size_t k = 0; k < texts[last].size(); ++k) common_batch_add(batch, texts[last][k], (llama_pos)k, {seq}, true); 
+                last++; 
+            } 
+            for (size_t k = 0; k < last - first; ++k) { 
+                llama_kv_self_seq_rm(ctx, embed_seqs[k], -1, -1); 
+                state.seq_tokens[embed_seqs[k]].clear(); 
+            } 
+            if ((use_encode ? llama_encode(ctx, batch) : llama_decode(ctx, batch)) != 0) { 
+                throw std::runtime_error("Failed to compute embeddings."); 
+            } 
+            int i_token = 0; 
+            for (size_t t = first; t < last; ++t) { 
+                const llama_seq_id seq = embed_seqs[t - first]; 
+                float* row = out + t * n_embd; 
+                if (pooled) { 
+                    const float* embd = llama_get_embeddings_seq(ctx, seq); 
+                    if (!embd) throw std::runtime_error("Failed to get pooled embeddings for sequence."); 
+                    std::copy(embd, embd + n_embd, row); 
+                    i_token += (int)texts[t].size(); 
+                } else { 
+                    std::fill(row, row + n_embd, 0.0f); 
+                    for (size_t k = 0; k < texts[t].size(); ++k, ++i_token) { 
+                        const float* embd = llama_get_embeddings_ith(ctx, i_token); 
+                        if (!embd) throw std::runtime_error("Failed to get token embeddings."); 
+                        for (int d = 0; d < n_embd; ++d) row[d] += embd[d]; 
+                    } 
+                    for (int d = 0; d < n_embd; ++d) row[d] /= (float)texts[t].size(); 
+                } 
+                if (normalize) { 
+                    double norm = 0.0; 
+                    for (int d = 0; d < n_embd; ++d) norm += (double)row[d] * row[d]; 
+                    norm = std::sqrt(norm); 
+                    if (norm > 0.0) for (int d = 0; d < n_embd; ++d) row[d] = (float)(row[d] / norm); 
+                } 
+            } 
+            for (size_t k = 0; k < last - first; ++k) llama_kv_self_seq_rm(ctx, embed_seqs[k], -1, -1); 
+            first = last; 
+        } 
+    } catch (...) { 
+        restore(); 
+        throw; 
+    } 
+    restore(); 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_embed(newrllama_context_handle ctx, const int32_t* tokens, size_t n_tokens, bool normalize, float** embedding_out, int* n_embd_out, const char** error_message) { 
+    if (!ctx) { 
+        set_error(error_message, "Context handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    try { 
+        const std::vector<std::vector<llama_token>> texts(1, std::vector<llama_token>(tokens, tokens + n_tokens)); 
+        const int n_embd = llama_model_n_embd(llama_get_model(ctx)); 
+        std::vector<float> out(n_embd); 
+        embed_sequences(ctx, texts, normalize, out.data()); 
+        *embedding_out = new float[n_embd]; 
+        std::copy(out.begin(), out.end(), *embedding_out); 
+        *n_embd_out = n_embd; 
+        return NEWRLLAMA_SUCCESS; 
+    } catch (const std::exception& e) { 
+        set_error(error_message, e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_embed_batch(newrllama_context_handle ctx, const char** texts, int n_texts, bool normalize, float** embeddings_out, int* n_embd_out, const char** error_message) { 
+    if (!ctx) { 
+        set_error(error_message, "Context handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const llama_model* model = llama_get_model(ctx); 
+    const int n_embd = llama_model_n_embd(model); 
+    float* out = new float[(size_t)std::max(n_texts, 0) * n_embd]; 
+    try { 
+        std::vector<std::vector<llama_token>> tokenized(std::max(n_texts, 0)); 
+        for (int i = 0; i < n_texts; ++i) tokenized[i] = helper_tokenize(model, std::string(texts[i]), true); 
+        embed_sequences(ctx, tokenized, normalize, out); 
+    } catch (const std::exception& e) { 
+        delete[] out; 
+        set_error(error_message, e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    *embeddings_out = out; 
+    *n_embd_out = n_embd; 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API void newrllama_free_embeddings(float* embeddings) { 
+    if (embeddings) delete[] embeddings; 
+} 
+
+// Scores (prompt, continuation) pairs without sampling. Pairs are grouped by prompt text and a
+// group's prompt is decoded once, as KV cells shared by the sequences of up to n_seq_max of its
+// continuations; each continuation then runs in its own sequence behind it. Several groups are
+// packed into each batch, as generate_parallel_impl packs its slots, and only positions whose
+// next token is scored request logits. Scoring runs in the sequences that hold no tokens (the
+// last sequence if all of them do) and in the KV cells the other sequences leave free.
+static void score_impl(llama_context* ctx, const char** prompts, const char** continuations, int n_pairs, const std::atomic<bool>* cancel, score_result& out, newrllama_perf_stats* stats_out) { 
+    context_state& state = get_context_state(ctx); 
+    std::lock_guard<std::mutex> run_lock(state.run_mutex); 
+    const auto t_start = std::chrono::steady_clock::now(); 
+    const llama_model* model = llama_get_model(ctx); 
+    const llama_vocab* vocab = llama_model_get_vocab(model); 
+    const int32_t n_vocab = llama_vocab_n_tokens(vocab); 
+    const int n_slots = (int)llama_n_seq_max(ctx); 
+    const int n_batch = (int)llama_n_batch(ctx); 
+    const size_t n_ctx = llama_n_ctx(ctx); 
+    n_pairs = std::max(n_pairs, 0); 
+
+    // Tokenize continuations into the output layout and prompts once per distinct text.
+    struct score_group { std::vector<llama_token> prompt; std::vector<int> pairs; }; 
+    std::vector<score_group> groups; 
+    std::unordered_map<std::string, size_t> group_of; 
+    out = score_result(); 
+    out.offsets.assign((size_t)n_pairs + 1, 0); 
+    out.logprob.assign(n_pairs, 0.0); 
+    for (int i = 0; i < n_pairs; ++i) { 
+        tokenize_append(vocab, continuations[i] ? continuations[i] : "", false, out.token); 
+        out.offsets[i + 1] = (int64_t)out.token.size(); 
+        if (out.offsets[i + 1] == out.offsets[i]) continue;   // nothing to score
+        auto it = group_of.emplace(prompts[i] ? prompts[i] : "", groups.size()); 
+        if (it.second) { 
+            groups.emplace_back(); 
+            groups.back().prompt = helper_tokenize(model, it.first->first, true); 
+            if (groups.back().prompt.empty()) throw std::runtime_error("Prompt " + std::to_string(i) + " produced no tokens."); 
+        } 
+        groups[it.first->second].pairs.push_back(i); 
+    } 
+    out.token_logprob.assign(out.token.size(), 0.0f); 
+    auto n_cont = [&](int pair) { return (size_t)(out.offsets[pair + 1] - out.offsets[pair]); }; 
+
+    // Chat sessions, pool leases and cached prompts of other calls keep their sequences.
+    std::vector<llama_seq_id> score_seqs; 
+    for (int s = 0; s < n_slots; ++s) { 
+        if (state.seq_tokens[s].empty()) score_seqs.push_back(s); 
+    } 
+    if (score_seqs.empty()) score_seqs.push_back(n_slots - 1); 
+    for (llama_seq_id seq : score_seqs) { 
+        llama_kv_self_seq_rm(ctx, seq, -1, -1); 
+        state.seq_tokens[seq].clear(); 
+    } 
+    const int n_seqs = (int)score_seqs.size(); 
+    const size_t n_cells_free = n_ctx - std::min(n_ctx, (size_t)std::max(llama_kv_self_used_cells(ctx), 0)); 
+
+    // A unit is one group's prompt with as many of its continuations as there are sequences
+    // and KV cells for. It is decoded as a stream: the prompt (in all the unit's sequences),
+    // then each continuation in its own sequence.
+    struct score_unit { 
+        const score_group* group = nullptr; 
+        std::vector<int> pairs; 
+        std::vector<llama_seq_id> seqs; 
+        size_t n_cells = 0; 
+        size_t next = 0;         // prompt tokens added so far
+        size_t k = 0, j = 0;     // then: continuation k, token j
+        bool done() const { return k >= pairs.size(); } 
+    }; 
+    std::deque<score_unit> pending; 
+    for (const score_group& g : groups) { 
+        for (int pair : g.pairs) { 
+            const size_t n_need = g.prompt.size() + n_cont(pair); 
+            if (n_need > n_cells_free) { 
+                throw std::runtime_error("Pair " + std::to_string(pair) + " has " + std::to_string(n_need) + " tokens, more than the context's free KV cells (" + std::to_string(n_cells_free) + ")."); 
+            } 
+            score_unit* u = pending.empty() ? nullptr : &pending.back(); 
+            if (!u || u->group != &g || (int)u->pairs.size() >= n_seqs || u->n_cells + n_cont(pair) > n_cells_free) { 
+                pending.emplace_back(); 
+                u = &pending.back(); 
+                u->group = &g; 
+                u->n_cells = g.prompt.size(); 
+            } 
+            u->pairs.push_back(pair); 
+            u->n_cells += n_cont(pair); 
+        } 
+    } 
+
+    std::vector<llama_seq_id> free_seqs(score_seqs.rbegin(), score_seqs.rend()); 
+    std::vector<score_unit> active; 
+    size_t n_cells_used = 0; 
+    // Batch rows with logits and the output token each one scores.
+    std::vector<std::pair<int32_t, int64_t>> rows; 
+    scoped_batch scoped(n_batch, n_slots);   // a shared prompt token carries every sequence of its unit
+    llama_batch& batch = scoped.batch; 
+    int64_t n_decoded = 0; 
+    int64_t n_shared = 0; 
+    int n_decode_calls = 0; 
+    double batch_fill_sum = 0.0; 
+    double busy_slot_sum = 0.0; 
+    double t_decode_ms = 0.0; 
+    double t_sample_ms = 0.0; 
+    while (!(cancel && *cancel)) { 
+        while (!pending.empty() && free_seqs.size() >= pending.front().pairs.size() && n_cells_used + pending.front().n_cells <= n_cells_free) { 
+            score_unit u = std::move(pending.front()); 
+            pending.pop_front(); 
+            for (size_t p = 0; p < u.pairs.size(); ++p) { 
+                u.seqs.push_back(free_seqs.back()); 
+                free_seqs.pop_back(); 
+            } 
+            n_cells_used += u.n_cells; 
+            n_shared += (int64_t)(u.pairs.size() - 1) * (int64_t)u.group->prompt.size(); 
+            active.push_back(std::move(u)); 
+        } 
+        if (active.empty()) break; 
+        common_batch_clear(batch); 
+        rows.clear(); 
+        for (score_unit& u : active) { 
+            const std::vector<llama_token>& prompt = u.group->prompt; 
+            for (; batch.n_tokens < n_batch && u.next < prompt.size(); ++u.next) { 
+                const bool last = u.next + 1 == prompt.size(); 
+                if (last) for (int pair : u.pairs) rows.emplace_back(batch.n_tokens, out.offsets[pair]); 
+                common_batch_add(batch, prompt[u.next], (llama_pos)u.next, u.seqs, last); 
+            } 
+            if (u.next < prompt.size()) break; 
+            for (; batch.n_tokens < n_batch && !u.done(); ) { 
+                const int pair = u.pairs[u.k]; 
+                const int64_t idx = out.offsets[pair] + (int64_t)u.j; 
+                const bool scored = u.j + 1 < n_cont(pair); 
+                if (scored) rows.emplace_back(batch.n_tokens, idx + 1); 
+                common_batch_add(batch, out.token[idx], (llama_pos)(prompt.size() + u.j), {u.seqs[u.k]}, scored); 
+                if (++u.j == n_cont(pair)) { 
+                    u.k++; 
+                    u.j = 0; 
+                } 
+            } 
+            if (batch.n_tokens >= n_batch) break; 
+        } 
+        const auto t0 = std::chrono::steady_clock::now(); 
+        if (llama_decode(ctx, batch) != 0) throw std::runtime_error("Failed to decode scoring batch."); 
+        llama_synchronize(ctx); 
+        t_decode_ms += elapsed_ms(t0); 
+        n_decoded += batch.n_tokens; 
+        n_decode_calls++; 
+        batch_fill_sum += (double)batch.n_tokens / n_batch; 
+        busy_slot_sum += (double)(n_seqs - (int)free_seqs.size()) / n_seqs; 
+        const auto t1 = std::chrono::steady_clock::now(); 
+        int32_t row_normed = -1; 
+        const float* logits = nullptr; 
+        float log_norm = 0.0f; 
+        for (const auto& row : rows) { 
+            if (row.first != row_normed) { 
+                logits = llama_get_logits_ith(ctx, row.first); 
+                if (!logits) throw std::runtime_error("Failed to get logits for scoring."); 
+                const float max_logit = *std::max_element(logits, logits + n_vocab); 
+                double sum = 0.0; 
+                for (int32_t i = 0; i < n_vocab; ++i) sum += std::exp((double)(logits[i] - max_logit)); 
+                log_norm = max_logit + (float)std::log(sum); 
+                row_normed = row.first; 
+            } 
+            out.token_logprob[row.second] = logits[out.token[row.second]] - log_norm; 
+        } 
+        t_sample_ms += elapsed_ms(t1); 
+        // Finished units hand their sequences and cells to the next pending units.
+        for (size_t a = 0; a < active.size(); ) { 
+            if (!active[a].done()) { 
+                a++; 
+                continue; 
+            } 
+            for (llama_seq_id seq : active[a].seqs) { 
+                llama_kv_self_seq_rm(ctx, seq, -1, -1); 
+                free_seqs.push_back(seq); 
+            } 
+            n_cells_used -= active[a].n_cells; 
+            active.erase(active.begin() + a); 
+        } 
+    } 
+    for (llama_seq_id seq : score_seqs) llama_kv_self_seq_rm(ctx, seq, -1, -1); 
+    // The first token of a continuation is scored from the prompt's last logits, so every
+    // token has a value and the totals are plain sums.
+    for (int i = 0; i < n_pairs; ++i) { 
+        double total = 0.0; 
+        for (int64_t t = out.offsets[i]; t < out.offsets[i + 1]; ++t) total += out.token_logprob[t]; 
+        out.logprob[i] = total; 
+    } 
+    if (stats_out) { 
+        const double t_ms = elapsed_ms(t_start); 
+        *stats_out = {}; 
+        stats_out->n_slots = n_seqs; 
+        stats_out->n_prompts = n_pairs; 
+        stats_out->n_prompt_tokens = n_decoded; 
+        stats_out->n_reused_prompt_tokens = n_shared; 
+        stats_out->n_decode_calls = n_decode_calls; 
+        stats_out->t_total_ms = t_ms; 
+        stats_out->t_prefill_ms = t_decode_ms; 
+        stats_out->t_sample_ms = t_sample_ms; 
+        stats_out->tokens_per_second = t_ms > 0.0 ? n_decoded * 1000.0 / t_ms : 0.0; 
+        stats_out->avg_batch_fill = n_decode_calls > 0 ? batch_fill_sum / n_decode_calls : 0.0; 
+        stats_out->avg_slot_occupancy = n_decode_calls > 0 ? busy_slot_sum / n_decode_calls : 0.0; 
+    } 
+} 
+
+static void score_result_to_c(const score_result& scores, newrllama_scores* out) { 
+    const size_t n_pairs = scores.logprob.size(); 
+    const size_t n_tokens = scores.token.size(); 
+    out->n_pairs = (int)n_pairs; 
+    out->logprob = new double[n_pairs]; 
+    out->offsets = new int64_t[n_pairs + 1]; 
+    out->token = new int32_t[n_tokens]; 
+    out->token_logprob = new float[n_tokens]; 
+    std::copy(scores.logprob.begin(), scores.logprob.end(), out->logprob); 
+    std::copy(scores.offsets.begin(), scores.offsets.end(), out->offsets); 
+    std::copy(scores.token.begin(), scores.token.end(), out->token); 
+    std::copy(scores.token_logprob.begin(), scores.token_logprob.end(), out->token_logprob); 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_score(newrllama_context_handle ctx, const char** prompts, const char** continuations, int n_pairs, struct newrllama_scores* scores_out, struct newrllama_perf_stats* stats_out, const char** error_message) { 
+    if (!ctx || !scores_out || (n_pairs > 0 && (!prompts || !continuations))) { 
+        set_error(error_message, "Context, texts or output handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    score_result scores; 
+    try { 
+        score_impl(ctx, prompts, continuations, n_pairs, nullptr, scores, stats_out); 
+    } catch (const std::exception& e) { 
+        set_error(error_message, e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    score_result_to_c(scores, scores_out); 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_score_async(newrllama_context_handle ctx, const char** prompts, const char** continuations, int n_pairs, newrllama_job_handle* job_out, const char** error_message) { 
+    if (!ctx || !job_out || (n_pairs > 0 && (!prompts || !continuations))) { 
+        set_error(error_message, "Context, texts or job handle is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    std::vector<std::string> prompt_copies, continuation_copies; 
+    for (int i = 0; i < n_pairs; ++i) { 
+        prompt_copies.emplace_back(prompts[i] ? prompts[i] : ""); 
+        continuation_copies.emplace_back(continuations[i] ? continuations[i] : ""); 
+    } 
+    try { 
+        *job_out = job_start([ctx, prompt_copies, continuation_copies](newrllama_job* job) { 
+            std::vector<const char*> prompt_ptrs, continuation_ptrs; 
+            for (const auto& s : prompt_copies) prompt_ptrs.push_back(s.c_str()); 
+            for (const auto& s : continuation_copies) continuation_ptrs.push_back(s.c_str()); 
+            score_impl(ctx, prompt_ptrs.data(), continuation_ptrs.data(), (int)prompt_ptrs.size(), &job->cancel, job->scores, &job->stats); 
+        }, {ctx}); 
+    } catch (const std::exception& e) { 
+        set_error(error_message, std::string("Failed to start scoring job: ") + e.what()); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_job_scores(newrllama_job_handle job, struct newrllama_scores* scores_out, struct newrllama_perf_stats* stats_out, const char** error_message) { 
+    if (!job || !scores_out) { 
+        set_error(error_message, "Job handle or output pointer is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    std::lock_guard<std::mutex> lock(job->mutex); 
+    if (job->state == NEWRLLAMA_JOB_RUNNING) { 
+        set_error(error_message, "Job is still running."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    if (job->state == NEWRLLAMA_JOB_FAILED) { 
+        set_error(error_message, job->error); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    score_result_to_c(job->scores, scores_out); 
+    if (stats_out) *stats_out = job->stats; 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API void newrllama_free_scores(struct newrllama_scores* scores) { 
+    if (!scores) return; 
+    delete[] scores->logprob; 
+    delete[] scores->offsets; 
+    delete[] scores->token; 
+    delete[] scores->token_logprob; 
+    *scores = {}; 
+} 
+
+// Full-state snapshots store every sequence's token history in the token list of the
+// llama state file, as [magic, n_seq, len_0 .. len_{n_seq-1}, tokens of seq 0, seq 1, ...].
+// Files without the magic (e.g. from other llama.cpp tools) are read as sequence 0's history.
+static const llama_token state_tokens_magic = 0x6E726C6D; 
+
+NEWRLLAMA_API newrllama_error_code newrllama_state_save(newrllama_context_handle ctx, const char* path, const char** error_message) { 
+    if (!ctx || !path) { 
+        set_error(error_message, "Context handle or path is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    context_state& state = get_context_state(ctx); 
+    std::lock_guard<std::mutex> run_lock(state.run_mutex); 
+    std::vector<llama_token> packed = {state_tokens_magic, (llama_token)state.seq_tokens.size()}; 
+    for (const auto& cached : state.seq_tokens) packed.push_back((llama_token)cached.size()); 
+    for (const auto& cached : state.seq_tokens) packed.insert(packed.end(), cached.begin(), cached.end()); 
+    if (!llama_state_save_file(ctx, path, packed.data(), packed.size())) { 
+        set_error(error_message, std::string("Failed to save context state to: ") + path); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_state_load(newrllama_context_handle ctx, const char* path, const char** error_message) { 
+    if (!ctx || !path) { 
+        set_error(error_message, "Context handle or path is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    context_state& state = get_context_state(ctx); 
+    std::lock_guard<std::mutex> run_lock(state.run_mutex); 
+    const size_t n_seq = state.seq_tokens.size(); 
+    std::vector<llama_token> packed((size_t)llama_n_ctx(ctx) * n_seq + n_seq + 2); 
+    size_t n_packed = 0; 
+    if (!llama_state_load_file(ctx, path, packed.data(), packed.size(), &n_packed)) { 
+        llama_kv_self_clear(ctx); 
+        for (auto& cached : state.seq_tokens) cached.clear(); 
+        set_error(error_message, std::string("Failed to load context state from: ") + path); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    for (auto& cached : state.seq_tokens) cached.clear(); 
+    if (n_packed >= 2 && packed[0] == state_tokens_magic && n_packed >= 2 + (size_t)packed[1]) { 
+        const size_t n_saved = (size_t)packed[1]; 
+        size_t offset = 2 + n_saved; 
+        for (size_t seq = 0; seq < n_saved; ++seq) { 
+            const size_t len = (size_t)packed[2 + seq]; 
+            if (offset + len > n_packed) break; 
+            if (seq < n_seq) state.seq_tokens[seq].assign(packed.begin() + offset, packed.begin() + offset + len); 
+            offset += len; 
+        } 
+    } else if (n_seq > 0) { 
+        state.seq_tokens[0].assign(packed.begin(), packed.begin() + n_packed); 
+    } 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_state_seq_save(newrllama_context_handle ctx, const char* path, int32_t seq_id, const char** error_message) { 
+    if (!ctx || !path) { 
+        set_error(error_message, "Context handle or path is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    context_state& state = get_context_state(ctx); 
+    std::lock_guard<std::mutex> run_lock(state.run_mutex); 
+    if (seq_id < 0 || (size_t)seq_id >= state.seq_tokens.size()) { 
+        set_error(error_message, "Sequence id " + std::to_string(seq_id) + " is out of range."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    const std::vector<llama_token>& cached = state.seq_tokens[seq_id]; 
+    if (llama_state_seq_save_file(ctx, path, seq_id, cached.data(), cached.size()) == 0) { 
+        set_error(error_message, std::string("Failed to save sequence state to: ") + path); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    return NEWRLLAMA_SUCCESS; 
+} 
+
+NEWRLLAMA_API newrllama_error_code newrllama_state_seq_load(newrllama_context_handle ctx, const char* path, int32_t seq_id, const char** error_message) { 
+    if (!ctx || !path) { 
+        set_error(error_message, "Context handle or path is null."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    context_state& state = get_context_state(ctx); 
+    std::lock_guard<std::mutex> run_lock(state.run_mutex); 
+    if (seq_id < 0 || (size_t)seq_id >= state.seq_tokens.size()) { 
+        set_error(error_message, "Sequence id " + std::to_string(seq_id) + " is out of range."); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    std::vector<llama_token> tokens(llama_n_ctx(ctx)); 
+    size_t n_tokens = 0; 
+    if (llama_state_seq_load_file(ctx, path, seq_id, tokens.data(), tokens.size(), &n_tokens) == 0) { 
+        llama_kv_self_seq_rm(ctx, seq_id, -1, -1); 
+        state.seq_tokens[seq_id].clear(); 
+        set_error(error_message, std::string("Failed to load sequence state from: ") + path); 
+        return NEWRLLAMA_ERROR; 
+    } 
+    tokens.resize(n_tokens); 
+    state.seq_tokens[seq_id] = std::move(tokens); 
+    return NEWRLLAMA_SUCCESS; 
+} 
 
 NEWRLLAMA_API void newrllama_free_string_array(char** arr, int count) { 
     if (arr) { 
@@ -22,23 +22,242 @@ extern "C" {
 typedef struct llama_model*  newrllama_model_handle;
 typedef struct llama_context* newrllama_context_handle;
 typedef enum { NEWRLLAMA_SUCCESS = 0, NEWRLLAMA_ERROR = 1 } newrllama_error_code;
+typedef struct newrllama_job* newrllama_job_handle;
+typedef struct newrllama_pool* newrllama_pool_handle;
+typedef struct newrllama_chat* newrllama_chat_handle;
+typedef enum { NEWRLLAMA_JOB_RUNNING = 0, NEWRLLAMA_JOB_DONE = 1, NEWRLLAMA_JOB_FAILED = 2, NEWRLLAMA_JOB_CANCELLED = 3 } newrllama_job_state;
 struct newrllama_chat_message { const char* role; const char* content; };
+// Streaming callback: receives each chunk of generated text, always ending on a complete UTF-8
+// character (not NUL-terminated), and the token that completed it (-1 for the final flush).
+// Returning false stops generation.
+typedef bool (*newrllama_token_callback)(const char* piece, size_t length, int32_t token, void* user_data);
+// grammar: optional GBNF grammar (start rule "root") the output must follow; NULL or "" leaves
+// sampling unconstrained. newrllama_json_schema_to_grammar builds one from a JSON schema.
+// n_probs > 0 records each generated token's log-probability and its n_probs most likely
+// alternatives (see newrllama_token_probs); 0 records nothing.
+// stop: n_stop strings that end generation as soon as the output contains one of them, even when
+// it spans several tokens; the output is cut before the stop string. Streaming callbacks are
+// handed text only once it can no longer turn into a stop string. max_tokens counts tokens.
+// Start from newrllama_sampling_default_params(), which sets struct_size: as with
+// newrllama_context_params, fields are only appended and those past a caller's struct_size keep
+// their defaults. An array of n_params sets is read with a stride of its first struct_size; a
+// struct_size too small to hold the fields through seed is rejected.
+struct newrllama_sampling_params { 
+    size_t struct_size; 
+    int max_tokens; int top_k; float top_p; float temperature; int repeat_last_n; float penalty_repeat; int32_t seed; 
+    const char* grammar; 
+    int n_probs; 
+    const char* const* stop; int n_stop; 
+};
+// Sampling settings of the 1.0.40 entry points newrllama_generate_parallel and
+// newrllama_generate_parallel_async; this layout never changes.
 struct newrllama_parallel_params { int max_tokens; int top_k; float top_p; float temperature; int repeat_last_n; float penalty_repeat; int32_t seed; };
+// Log-probabilities for one generated text. token[i] and logprob[i] describe the i-th generated
+// token; top_token and top_logprob hold its n_probs most likely alternatives, most likely first,
+// at [i * n_probs, (i + 1) * n_probs). Values are the log-softmax of the model's logits, before
+// penalties, truncation, temperature or grammar. Free with newrllama_free_token_probs.
+struct newrllama_token_probs { int64_t n_tokens; int n_probs; int32_t* token; float* logprob; int32_t* top_token; float* top_logprob; };
+// Per-call report filled by newrllama_generate_ext and newrllama_generate_parallel_ext. t_prefill_ms and
+// t_decode_ms are llama_decode compute time for prompt and generated tokens (a mixed parallel
+// step is split by token share); avg_batch_fill is the mean fraction of n_batch used per
+// llama_decode and avg_slot_occupancy the mean fraction of sequence slots busy per step.
+// Speculative generation also reports drafted and accepted draft tokens and the draft model's
+// time; t_decode_ms then covers the target's verification batches. Other calls leave them 0.
+// n_context_shifts counts the KV cache shifts a ctx_shift context made to keep generating.
+struct newrllama_perf_stats { int n_slots; int n_prompts; int64_t n_prompt_tokens; int64_t n_reused_prompt_tokens; int64_t n_generated_tokens; int n_decode_calls; double t_total_ms; double t_prefill_ms; double t_decode_ms; double t_sample_ms; double t_detokenize_ms; double tokens_per_second; double avg_batch_fill; double avg_slot_occupancy; int32_t n_kv_cells_used; int64_t n_drafted_tokens; int64_t n_accepted_tokens; double t_draft_ms; int n_context_shifts; };
+// Scores from newrllama_score: logprob[i] is the total log-likelihood of continuation i given
+// prompt i, and its tokens token[offsets[i] .. offsets[i + 1]) have per-token log-probabilities
+// token_logprob at the same positions. Free with newrllama_free_scores.
+struct newrllama_scores { int n_pairs; double* logprob; int64_t* offsets; int32_t* token; float* token_logprob; };
+// Context settings for newrllama_context_create_ext. Start from newrllama_context_default_params(),
+// which also sets struct_size: fields are only ever appended, and the library takes the ones past
+// a caller's struct_size from its defaults, so code built against an older header keeps working.
+// A struct_size too small to hold the fields through defrag_thold is rejected.
+// n_batch is the most tokens per llama_decode call, n_ubatch the most per compute step;
+// n_threads_batch (<= 0: n_threads) serves prompt processing. type_k/type_v are ggml_type values
+// for the KV cache (1 f16, 8 q8_0, 2 q4_0, ...); a quantized V cache needs flash_attn.
+// rope_scaling_type: -1 model default, 0 none, 1 linear, 2 yarn; zero rope_freq_base,
+// rope_freq_scale and yarn_orig_ctx keep the model's values. defrag_thold < 0 disables KV defragmentation.
+// lookup_n_draft > 0 turns on prompt-lookup speculation for generation on this context: up to
+// that many tokens following the latest earlier match of the last 1..lookup_ngram_max tokens
+// (in the prompt and the output so far) are verified in the same decode as the next token.
+// ctx_shift lets generation run past a sequence's share of the context (n_ctx / n_seq_max): when
+// it is full, the older half of the tokens after the first n_keep (< 0: the whole prompt) is
+// dropped from the KV cache and the rest moved back, and generation goes on without a new
+// prefill. Without it, or when n_keep leaves nothing to drop, decoding past the end fails.
+struct newrllama_context_params { 
+    size_t struct_size; 
+    int n_ctx; int n_threads; int n_seq_max; bool embeddings; int pooling_type; 
+    int n_batch; int n_ubatch; int n_threads_batch; 
+    bool flash_attn; int type_k; int type_v; bool offload_kqv; 
+    int rope_scaling_type; float rope_freq_base; float rope_freq_scale; int yarn_orig_ctx; 
+    float defrag_thold; 
+    int lookup_n_draft; int lookup_ngram_max; 
+    bool ctx_shift; int n_keep; 
+};
 
 NEWRLLAMA_API newrllama_error_code newrllama_backend_init(const char** error_message);
 NEWRLLAMA_API void newrllama_backend_free();
+// CPU kernels in use after newrllama_backend_init. variant_out names the ggml-cpu module that
+// runtime dispatch picked for this host ("haswell", "skylakex", "sapphirerapids", ...) or is
+// "builtin" for a library built with one fixed kernel set; features_out lists the instruction
+// set features those kernels use, comma separated ("AVX2,FMA,F16C,..."). Free both with
+// newrllama_free_string.
+NEWRLLAMA_API newrllama_error_code newrllama_cpu_info(char** variant_out, char** features_out, const char** error_message);
+// Loading a file that is already loaded with the same n_gpu_layers/use_mmap/use_mlock returns the
+// same model. Models are reference counted: each model_load handle and each context holds one
+// reference, and newrllama_model_free drops the caller's.
 NEWRLLAMA_API newrllama_error_code newrllama_model_load(const char* model_path, int n_gpu_layers, bool use_mmap, bool use_mlock, newrllama_model_handle* model_handle_out, const char** error_message);
 NEWRLLAMA_API void newrllama_model_free(newrllama_model_handle model);
+// Cache policy for models no handle or context references any more: up to max_idle_models stay
+// loaded for a later model_load (default 0, free at once), and those idle for idle_timeout_seconds
+// or longer (< 0: no limit) are freed. Expiry is checked on model load/free and cache calls.
+NEWRLLAMA_API void newrllama_model_cache_set_policy(int max_idle_models, double idle_timeout_seconds);
+NEWRLLAMA_API void newrllama_model_cache_clear();
+NEWRLLAMA_API void newrllama_model_cache_info(int* n_models_out, int* n_idle_out);
 NEWRLLAMA_API newrllama_error_code newrllama_context_create(newrllama_model_handle model, int n_ctx, int n_threads, int n_seq_max, newrllama_context_handle* context_handle_out, const char** error_message);
+// pooling_type takes llama_pooling_type values: -1 model default, 0 none, 1 mean, 2 cls, 3 last, 4 rank.
+NEWRLLAMA_API struct newrllama_context_params newrllama_context_default_params();
+NEWRLLAMA_API newrllama_error_code newrllama_context_create_ext(newrllama_model_handle model, const struct newrllama_context_params* params, newrllama_context_handle* context_handle_out, const char** error_message);
+// Blocks until the async jobs using the context have finished (cancel them to make that quick),
+// then frees it. Chats created on the context must be freed first.
 NEWRLLAMA_API void newrllama_context_free(newrllama_context_handle ctx);
+// Generation reuses whatever prompt prefix is already in a sequence's KV cache; this drops it.
+NEWRLLAMA_API void newrllama_kv_cache_clear(newrllama_context_handle ctx);
 NEWRLLAMA_API newrllama_error_code newrllama_tokenize(newrllama_model_handle model, const char* text, bool add_special, int32_t** tokens_out, size_t* n_tokens_out, const char** error_message);
+// Tokenizes into a caller-owned buffer (e.g. memory the caller will keep as its result).
+// *n_tokens_out always receives the exact token count; the tokens are written only when they fit
+// in buf_size, so a caller can size its buffer from a first call (buf_size 0 is allowed).
+NEWRLLAMA_API newrllama_error_code newrllama_tokenize_into(newrllama_model_handle model, const char* text, bool add_special, int32_t* buf, size_t buf_size, size_t* n_tokens_out, const char** error_message);
 NEWRLLAMA_API newrllama_error_code newrllama_detokenize(newrllama_model_handle model, const int32_t* tokens, size_t n_tokens, char** text_out, const char** error_message);
+// Writes the text into a caller-owned buffer. *length_out always receives the exact text length;
+// the NUL-terminated text is written only when it is smaller than buf_size, so a caller can size
+// its buffer from a first call (buf_size 0 is allowed) and reuse it across calls.
+NEWRLLAMA_API newrllama_error_code newrllama_detokenize_into(newrllama_model_handle model, const int32_t* tokens, size_t n_tokens, char* buf, size_t buf_size, size_t* length_out, const char** error_message);
+// Detokenizes n_seqs token sequences laid out as tokenize_batch returns them (sequence i is
+// tokens[offsets[i], offsets[i + 1])) into one text buffer (freed with newrllama_free_string) and
+// n_seqs + 1 offsets (freed with newrllama_free_offsets): text i is text[offsets[i], offsets[i + 1]).
+NEWRLLAMA_API newrllama_error_code newrllama_detokenize_batch(newrllama_model_handle model, const int32_t* tokens, const int64_t* offsets, int n_seqs, char** text_out, int64_t** offsets_out, const char** error_message);
 NEWRLLAMA_API void newrllama_free_string(char* str);
 NEWRLLAMA_API void newrllama_free_tokens(int32_t* tokens);
+// Tokenizes n_texts strings on n_threads worker threads (<= 0: one per core) into one flat token
+// buffer (freed with newrllama_free_tokens) plus n_texts + 1 offsets (freed with
+// newrllama_free_offsets): text i occupies tokens[offsets[i], offsets[i + 1]).
+NEWRLLAMA_API newrllama_error_code newrllama_tokenize_batch(newrllama_model_handle model, const char** texts, int n_texts, bool add_special, int n_threads, int32_t** tokens_out, int64_t** offsets_out, const char** error_message);
+NEWRLLAMA_API void newrllama_free_offsets(int64_t* offsets);
 NEWRLLAMA_API newrllama_error_code newrllama_apply_chat_template(newrllama_model_handle model, const char* tmpl, const struct newrllama_chat_message* messages, size_t n_messages, bool add_ass, char** result_out, const char** error_message);
 NEWRLLAMA_API newrllama_error_code newrllama_generate(newrllama_context_handle ctx, const int32_t* tokens_in, size_t n_tokens_in, int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, char** result_out, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_generate_stream(newrllama_context_handle ctx, const int32_t* tokens_in, size_t n_tokens_in, int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, newrllama_token_callback callback, void* user_data, char** result_out, const char** error_message);
 NEWRLLAMA_API newrllama_error_code newrllama_generate_parallel(newrllama_context_handle ctx, const char** prompts, int n_prompts, const struct newrllama_parallel_params* params, char*** results_out, const char** error_message);
 NEWRLLAMA_API void newrllama_free_string_array(char** arr, int count);
+NEWRLLAMA_API struct newrllama_sampling_params newrllama_sampling_default_params();
+// Parallel generation with n_params sets of sampling parameters: 1 shared by all prompts, or
+// n_prompts, one per prompt, so requests with different settings share the decode batches. Each
+// prompt has its own sampler; a shared seed >= 0 is offset by the prompt index, so identical
+// prompts draw independent yet reproducible samples, and a seed < 0 picks a random one.
+NEWRLLAMA_API newrllama_error_code newrllama_generate_parallel_ext(newrllama_context_handle ctx, const char** prompts, int n_prompts, const struct newrllama_sampling_params* params, int n_params, char*** results_out, struct newrllama_perf_stats* stats_out, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_generate_parallel_ext_async(newrllama_context_handle ctx, const char** prompts, int n_prompts, const struct newrllama_sampling_params* params, int n_params, newrllama_job_handle* job_out, const char** error_message);
+// Single-sequence generation taking the full newrllama_sampling_params (grammar included);
+// `callback`, `stats_out` and `probs_out` may be NULL. The async form returns a job as
+// newrllama_generate_async does.
+NEWRLLAMA_API newrllama_error_code newrllama_generate_ext(newrllama_context_handle ctx, const int32_t* tokens_in, size_t n_tokens_in, const struct newrllama_sampling_params* params, newrllama_token_callback callback, void* user_data, char** result_out, struct newrllama_perf_stats* stats_out, struct newrllama_token_probs* probs_out, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_generate_ext_async(newrllama_context_handle ctx, const int32_t* tokens_in, size_t n_tokens_in, const struct newrllama_sampling_params* params, newrllama_job_handle* job_out, const char** error_message);
+// Converts a JSON schema (as JSON text) into a GBNF grammar for newrllama_sampling_params.grammar.
+// Free the result with newrllama_free_string.
+NEWRLLAMA_API newrllama_error_code newrllama_json_schema_to_grammar(const char* schema_json, char** grammar_out, const char** error_message);
+// Asynchronous generation: the request runs on a backend thread and the call returns a job at
+// once. Jobs on the same context run one after another. Cancellation takes effect between
+// llama_decode steps; a cancelled job keeps the text generated so far. newrllama_job_wait
+// waits up to timeout_ms (< 0: no limit) and returns the state (FAILED for a null job, as
+// newrllama_job_status). newrllama_job_result copies
+// the outputs of a finished job (free with newrllama_free_string_array); newrllama_job_free
+// cancels a running job and waits for it before releasing it. A job holds its context (and a
+// speculative job its draft context) until its work returns; newrllama_context_free waits for it.
+NEWRLLAMA_API newrllama_error_code newrllama_generate_async(newrllama_context_handle ctx, const int32_t* tokens_in, size_t n_tokens_in, int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, newrllama_job_handle* job_out, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_generate_parallel_async(newrllama_context_handle ctx, const char** prompts, int n_prompts, const struct newrllama_parallel_params* params, newrllama_job_handle* job_out, const char** error_message);
+NEWRLLAMA_API newrllama_job_state newrllama_job_status(newrllama_job_handle job);
+NEWRLLAMA_API newrllama_job_state newrllama_job_wait(newrllama_job_handle job, int timeout_ms);
+NEWRLLAMA_API void newrllama_job_cancel(newrllama_job_handle job);
+NEWRLLAMA_API newrllama_error_code newrllama_job_result(newrllama_job_handle job, char*** results_out, int* n_results_out, struct newrllama_perf_stats* stats_out, const char** error_message);
+NEWRLLAMA_API void newrllama_job_free(newrllama_job_handle job);
+// The outputs of a finished job as one text buffer (freed with newrllama_free_string) and
+// n_results + 1 offsets (freed with newrllama_free_offsets): result i is text[offsets[i],
+// offsets[i + 1]). Two allocations whatever the number of results, and the caller can keep
+// the buffer as is rather than copying every string out of it.
+NEWRLLAMA_API newrllama_error_code newrllama_job_result_arena(newrllama_job_handle job, char** text_out, int64_t** offsets_out, int* n_results_out, struct newrllama_perf_stats* stats_out, const char** error_message);
+// Log-probabilities of result `index` of a finished job started with params.n_probs > 0
+// (newrllama_generate_ext_async, newrllama_generate_parallel_async or
+// newrllama_generate_speculative_async); n_tokens is 0 when none were recorded.
+NEWRLLAMA_API newrllama_error_code newrllama_job_token_probs(newrllama_job_handle job, int index, struct newrllama_token_probs* probs_out, const char** error_message);
+NEWRLLAMA_API void newrllama_free_token_probs(struct newrllama_token_probs* probs);
+// Speculative decoding: draft_ctx (a context of a small model with the same vocabulary) drafts
+// up to n_draft tokens per step and the target checks them in one batched decode, keeping the
+// longest prefix that matches its own sampling. The output follows the target's sampling; only
+// the number of target decode calls changes. draft_ctx needs at least the target's tokens per
+// sequence (n_ctx / n_seq_max) and, if the target has ctx_shift, a KV cache that can shift.
+NEWRLLAMA_API newrllama_error_code newrllama_generate_speculative(newrllama_context_handle ctx, newrllama_context_handle draft_ctx, const int32_t* tokens_in, size_t n_tokens_in, const struct newrllama_sampling_params* params, int n_draft, char** result_out, struct newrllama_perf_stats* stats_out, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_generate_speculative_async(newrllama_context_handle ctx, newrllama_context_handle draft_ctx, const int32_t* tokens_in, size_t n_tokens_in, const struct newrllama_sampling_params* params, int n_draft, newrllama_job_handle* job_out, const char** error_message);
+// Generation in one sequence of a context; other sequences' KV contents are left untouched.
+NEWRLLAMA_API newrllama_error_code newrllama_generate_seq(newrllama_context_handle ctx, int32_t seq_id, const int32_t* tokens_in, size_t n_tokens_in, int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, char** result_out, struct newrllama_perf_stats* stats_out, const char** error_message);
+// Context pool: n_contexts contexts created up front from `params` (embeddings is ignored), each
+// offering params->n_seq_max sequences. A request leases one (context, sequence) pair with
+// newrllama_pool_acquire, which waits up to timeout_ms (< 0: no limit) in first-come order and
+// picks the least busy context; release clears the sequence and hands it to the next waiter.
+// Leases of the same context take turns on its decode loop, so only leases on different contexts
+// run concurrently; n_seq_max > 1 trades that for a shared KV cache. newrllama_pool_generate_async
+// leases, generates and releases on a job thread. newrllama_pool_free waits for outstanding
+// leases before freeing the contexts.
+NEWRLLAMA_API newrllama_error_code newrllama_pool_create(newrllama_model_handle model, int n_contexts, const struct newrllama_context_params* params, newrllama_pool_handle* pool_out, const char** error_message);
+NEWRLLAMA_API void newrllama_pool_free(newrllama_pool_handle pool);
+NEWRLLAMA_API newrllama_error_code newrllama_pool_acquire(newrllama_pool_handle pool, int timeout_ms, newrllama_context_handle* ctx_out, int32_t* seq_id_out, const char** error_message);
+NEWRLLAMA_API void newrllama_pool_release(newrllama_pool_handle pool, newrllama_context_handle ctx, int32_t seq_id);
+NEWRLLAMA_API newrllama_error_code newrllama_pool_generate_async(newrllama_pool_handle pool, const int32_t* tokens_in, size_t n_tokens_in, int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, newrllama_job_handle* job_out, const char** error_message);
+NEWRLLAMA_API void newrllama_pool_info(newrllama_pool_handle pool, int* n_leases_out, int* n_busy_out, int* n_waiting_out);
+// Chat session: a multi-turn conversation kept in sequence seq_id of ctx, whose KV cache holds
+// every turn so far. newrllama_chat_send adds a user message, tokenizes and decodes only what
+// the chat template adds for it (the previous turn's end, the message and the assistant header)
+// after the cached history, generates the reply and keeps it in the cache for the next turn.
+// tmpl NULL uses the model's template; system_prompt may be NULL. The session borrows ctx,
+// which must outlive it, and the sequence should serve only this session; other sequences of
+// ctx stay free for other calls. newrllama_chat_reset drops every message but the system
+// prompt; the cached tokens are reused as far as the next turn matches them. chat_messages
+// returns copies of the roles and contents (free each with newrllama_free_string_array).
+// newrllama_chat_free blocks until the chat's async turns have finished (cancel them to make
+// that quick), then leaves the conversation's tokens in the sequence's KV cache; a later call
+// on that sequence reuses or replaces them, and newrllama_kv_cache_clear drops them.
+NEWRLLAMA_API newrllama_error_code newrllama_chat_create(newrllama_context_handle ctx, int32_t seq_id, const char* tmpl, const char* system_prompt, newrllama_chat_handle* chat_out, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_chat_send(newrllama_chat_handle chat, const char* message, const struct newrllama_sampling_params* params, newrllama_token_callback callback, void* user_data, char** reply_out, struct newrllama_perf_stats* stats_out, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_chat_send_async(newrllama_chat_handle chat, const char* message, const struct newrllama_sampling_params* params, newrllama_job_handle* job_out, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_chat_messages(newrllama_chat_handle chat, char*** roles_out, char*** contents_out, int* n_messages_out, const char** error_message);
+NEWRLLAMA_API void newrllama_chat_info(newrllama_chat_handle chat, int* n_messages_out, int* n_tokens_out);
+NEWRLLAMA_API void newrllama_chat_reset(newrllama_chat_handle chat);
+NEWRLLAMA_API void newrllama_chat_free(newrllama_chat_handle chat);
+// Embeddings are returned as one contiguous row-major float matrix (n_texts x n_embd),
+// freed with newrllama_free_embeddings. Texts are packed across sequences into shared batches:
+// the sequences holding no tokens, or the last sequence (whose tokens are dropped) if every one
+// holds some; the other sequences, such as a chat session's, keep their tokens.
+NEWRLLAMA_API newrllama_error_code newrllama_embed(newrllama_context_handle ctx, const int32_t* tokens, size_t n_tokens, bool normalize, float** embedding_out, int* n_embd_out, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_embed_batch(newrllama_context_handle ctx, const char** texts, int n_texts, bool normalize, float** embeddings_out, int* n_embd_out, const char** error_message);
+NEWRLLAMA_API void newrllama_free_embeddings(float* embeddings);
+// Prompt scoring: the log-likelihood of each continuation given its prompt, with no sampling.
+// The prompt is tokenized with BOS and the continuation without, and each continuation token is
+// scored from the logits of the token before it. Pairs with the same prompt text decode it once
+// and share its KV cells across the sequences scoring uses; many pairs go into each batch.
+// Scoring uses the sequences holding no tokens, or the last sequence (whose tokens it drops) if
+// every one holds some, and only the KV cells the others leave free; chat sessions and the
+// cached prompts of other sequences are kept. stats_out (may be NULL) counts decoded tokens as prompt tokens
+// and the prompt tokens saved by sharing as reused. The async form returns a job whose scores
+// newrllama_job_scores copies out; a cancelled job leaves the pairs it did not reach at 0.
+NEWRLLAMA_API newrllama_error_code newrllama_score(newrllama_context_handle ctx, const char** prompts, const char** continuations, int n_pairs, struct newrllama_scores* scores_out, struct newrllama_perf_stats* stats_out, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_score_async(newrllama_context_handle ctx, const char** prompts, const char** continuations, int n_pairs, newrllama_job_handle* job_out, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_job_scores(newrllama_job_handle job, struct newrllama_scores* scores_out, struct newrllama_perf_stats* stats_out, const char** error_message);
+NEWRLLAMA_API void newrllama_free_scores(struct newrllama_scores* scores);
+// Session snapshots: the KV cache plus the token history used for prompt-prefix reuse.
+// The seq variants save or restore a single sequence; loading replaces that sequence only.
+NEWRLLAMA_API newrllama_error_code newrllama_state_save(newrllama_context_handle ctx, const char* path, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_state_load(newrllama_context_handle ctx, const char* path, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_state_seq_save(newrllama_context_handle ctx, const char* path, int32_t seq_id, const char** error_message);
+NEWRLLAMA_API newrllama_error_code newrllama_state_seq_load(newrllama_context_handle ctx, const char* path, int32_t seq_id, const char** error_message);
 NEWRLLAMA_API newrllama_error_code newrllama_token_get_text(newrllama_model_handle model, int32_t token, char** text_out, const char** error_message);
 NEWRLLAMA_API float newrllama_token_get_score(newrllama_model_handle model, int32_t token);
 NEWRLLAMA_API int newrllama_token_get_attr(newrllama_model_handle model, int32_t token);
@@ -8,17 +8,59 @@ extern "C" {
   // Proxy initialization function
   void r_newrllama_api_init(SEXP handle_sexp);
   void r_newrllama_api_reset();
+  void newrllama_altrep_init(DllInfo* dll);
   
   // Core functions
   SEXP r_backend_init();
   SEXP r_backend_free();
+  SEXP r_cpu_info();
   SEXP r_model_load(SEXP model_path, SEXP n_gpu_layers, SEXP use_mmap, SEXP use_mlock);
-  SEXP r_context_create(SEXP model_ptr, SEXP n_ctx, SEXP n_threads, SEXP n_seq_max);
+  SEXP r_model_cache_policy(SEXP max_idle, SEXP idle_timeout);
+  SEXP r_model_cache_clear();
+  SEXP r_model_cache_info();
+  SEXP r_context_create(SEXP model_ptr, SEXP params);
+  SEXP r_kv_cache_clear(SEXP ctx_ptr);
   SEXP r_tokenize(SEXP model_ptr, SEXP text, SEXP add_special);
+  SEXP r_tokenize_batch(SEXP model_ptr, SEXP texts, SEXP add_special, SEXP n_threads, SEXP flat);
   SEXP r_detokenize(SEXP model_ptr, SEXP tokens);
+  SEXP r_detokenize_batch(SEXP model_ptr, SEXP tokens);
   SEXP r_apply_chat_template(SEXP model_ptr, SEXP tmpl, SEXP chat_messages, SEXP add_ass);
-  SEXP r_generate(SEXP ctx_ptr, SEXP tokens, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed);
-  SEXP r_generate_parallel(SEXP ctx_ptr, SEXP prompts, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed);
+  SEXP r_generate(SEXP ctx_ptr, SEXP tokens, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed, SEXP return_stats, SEXP draft_ptr, SEXP n_draft, SEXP grammar, SEXP n_probs, SEXP stop_strings);
+  SEXP r_generate_stream(SEXP ctx_ptr, SEXP tokens, SEXP callback, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed, SEXP grammar, SEXP stop_strings);
+  SEXP r_generate_parallel(SEXP ctx_ptr, SEXP prompts, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed, SEXP return_stats, SEXP grammar, SEXP n_probs, SEXP stop_strings);
+  SEXP r_json_schema_to_grammar(SEXP schema);
+  SEXP r_score(SEXP ctx_ptr, SEXP prompts, SEXP continuations, SEXP return_stats);
+  
+  // Generation job functions
+  SEXP r_generate_async(SEXP ctx_ptr, SEXP tokens, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed);
+  SEXP r_generate_parallel_async(SEXP ctx_ptr, SEXP prompts, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed);
+  SEXP r_job_status(SEXP job_ptr);
+  SEXP r_job_wait(SEXP job_ptr, SEXP timeout);
+  SEXP r_job_cancel(SEXP job_ptr);
+  SEXP r_job_result(SEXP job_ptr, SEXP return_stats);
+  
+  // Context pool functions
+  SEXP r_pool_create(SEXP model_ptr, SEXP n_contexts, SEXP params);
+  SEXP r_pool_generate(SEXP pool_ptr, SEXP tokens, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed, SEXP return_stats);
+  SEXP r_pool_generate_async(SEXP pool_ptr, SEXP tokens, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed);
+  SEXP r_pool_info(SEXP pool_ptr);
+  
+  // Chat session functions
+  SEXP r_chat_create(SEXP ctx_ptr, SEXP seq_id, SEXP tmpl, SEXP system_prompt);
+  SEXP r_chat_send(SEXP chat_ptr, SEXP message, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed, SEXP grammar, SEXP stop_strings, SEXP callback, SEXP return_stats);
+  SEXP r_chat_history(SEXP chat_ptr);
+  SEXP r_chat_info(SEXP chat_ptr);
+  SEXP r_chat_reset(SEXP chat_ptr);
+  
+  // Embedding functions
+  SEXP r_embed(SEXP ctx_ptr, SEXP tokens, SEXP normalize);
+  SEXP r_embed_batch(SEXP ctx_ptr, SEXP texts, SEXP normalize);
+  
+  // State snapshot functions
+  SEXP r_state_save(SEXP ctx_ptr, SEXP path);
+  SEXP r_state_load(SEXP ctx_ptr, SEXP path);
+  SEXP r_state_seq_save(SEXP ctx_ptr, SEXP path, SEXP seq_id);
+  SEXP r_state_seq_load(SEXP ctx_ptr, SEXP path, SEXP seq_id);
   
   // Token functions
   SEXP r_token_get_text(SEXP model_ptr, SEXP token);
@@ -38,8 +80,20 @@ extern "C" {
   SEXP r_token_is_eog(SEXP model_ptr, SEXP token);
   SEXP r_token_is_control(SEXP model_ptr, SEXP token);
   
+  // Benchmark helper
+  SEXP r_peak_rss_mb();
+  
   // Test function for debugging
   SEXP r_tokenize_test(SEXP model_ptr);
+  
+  // Model-free helpers for the package tests
+  SEXP r_test_parallel_slot_count(SEXP n_seq_max, SEXP n_prompts, SEXP n_batch);
+  SEXP r_test_context_shift_size(SEXP n_cached, SEXP n_add, SEXP n_ctx_seq, SEXP n_keep);
+  SEXP r_test_stop_matcher(SEXP pieces, SEXP stop_strings);
+  SEXP r_test_lookup_draft(SEXP history, SEXP ngram_max, SEXP n_want);
+  SEXP r_test_offsets_valid(SEXP offsets, SEXP n_tokens);
+  SEXP r_test_trace_sequence(SEXP n_tokens_in, SEXP n_prefilled, SEXP n_keep, SEXP n_discarded, SEXP n_cached);
+  SEXP r_test_chat_kept_tokens(SEXP cached, SEXP trace, SEXP reply, SEXP pieces);
 }
 
 // 定义C例程表
@@ -51,13 +105,54 @@ static const R_CallMethodDef CallEntries[] = {
   // Core functions
   {"c_r_backend_init", (DL_FUNC) &r_backend_init, 0},
   {"c_r_backend_free", (DL_FUNC) &r_backend_free, 0},
+  {"c_r_cpu_info", (DL_FUNC) &r_cpu_info, 0},
   {"c_r_model_load", (DL_FUNC) &r_model_load, 4},
-  {"c_r_context_create", (DL_FUNC) &r_context_create, 4},
+  {"c_r_model_cache_policy", (DL_FUNC) &r_model_cache_policy, 2},
+  {"c_r_model_cache_clear", (DL_FUNC) &r_model_cache_clear, 0},
+  {"c_r_model_cache_info", (DL_FUNC) &r_model_cache_info, 0},
+  {"c_r_context_create", (DL_FUNC) &r_context_create, 2},
+  {"c_r_kv_cache_clear", (DL_FUNC) &r_kv_cache_clear, 1},
   {"c_r_tokenize", (DL_FUNC) &r_tokenize, 3},
+  {"c_r_tokenize_batch", (DL_FUNC) &r_tokenize_batch, 5},
   {"c_r_detokenize", (DL_FUNC) &r_detokenize, 2},
+  {"c_r_detokenize_batch", (DL_FUNC) &r_detokenize_batch, 2},
   {"c_r_apply_chat_template", (DL_FUNC) &r_apply_chat_template, 4},
-  {"c_r_generate", (DL_FUNC) &r_generate, 9},
-  {"c_r_generate_parallel", (DL_FUNC) &r_generate_parallel, 9},
+  {"c_r_generate", (DL_FUNC) &r_generate, 15},
+  {"c_r_generate_stream", (DL_FUNC) &r_generate_stream, 12},
+  {"c_r_generate_parallel", (DL_FUNC) &r_generate_parallel, 13},
+  {"c_r_json_schema_to_grammar", (DL_FUNC) &r_json_schema_to_grammar, 1},
+  {"c_r_score", (DL_FUNC) &r_score, 4},
+  
+  // Generation job functions
+  {"c_r_generate_async", (DL_FUNC) &r_generate_async, 9},
+  {"c_r_generate_parallel_async", (DL_FUNC) &r_generate_parallel_async, 9},
+  {"c_r_job_status", (DL_FUNC) &r_job_status, 1},
+  {"c_r_job_wait", (DL_FUNC) &r_job_wait, 2},
+  {"c_r_job_cancel", (DL_FUNC) &r_job_cancel, 1},
+  {"c_r_job_result", (DL_FUNC) &r_job_result, 2},
+  
+  // Context pool functions
+  {"c_r_pool_create", (DL_FUNC) &r_pool_create, 3},
+  {"c_r_pool_generate", (DL_FUNC) &r_pool_generate, 10},
+  {"c_r_pool_generate_async", (DL_FUNC) &r_pool_generate_async, 9},
+  {"c_r_pool_info", (DL_FUNC) &r_pool_info, 1},
+  
+  // Chat session functions
+  {"c_r_chat_create", (DL_FUNC) &r_chat_create, 4},
+  {"c_r_chat_send", (DL_FUNC) &r_chat_send, 13},
+  {"c_r_chat_history", (DL_FUNC) &r_chat_history, 1},
+  {"c_r_chat_info", (DL_FUNC) &r_chat_info, 1},
+  {"c_r_chat_reset", (DL_FUNC) &r_chat_reset, 1},
+  
+  // Embedding functions
+  {"c_r_embed", (DL_FUNC) &r_embed, 3},
+  {"c_r_embed_batch", (DL_FUNC) &r_embed_batch, 3},
+  
+  // State snapshot functions
+  {"c_r_state_save", (DL_FUNC) &r_state_save, 2},
+  {"c_r_state_load", (DL_FUNC) &r_state_load, 2},
+  {"c_r_state_seq_save", (DL_FUNC) &r_state_seq_save, 3},
+  {"c_r_state_seq_load", (DL_FUNC) &r_state_seq_load, 3},
   
   // Token functions
   {"c_r_token_get_text", (DL_FUNC) &r_token_get_text, 2},
@@ -77,15 +172,28 @@ static const R_CallMethodDef CallEntries[] = {
   {"c_r_token_is_eog", (DL_FUNC) &r_token_is_eog, 2},
   {"c_r_token_is_control", (DL_FUNC) &r_token_is_control, 2},
   
+  // Benchmark helper
+  {"c_r_peak_rss_mb", (DL_FUNC) &r_peak_rss_mb, 0},
+  
   // Test function
   {"c_r_tokenize_test", (DL_FUNC) &r_tokenize_test, 1},
   
+  // Model-free helpers for the package tests
+  {"c_r_test_parallel_slot_count", (DL_FUNC) &r_test_parallel_slot_count, 3},
+  {"c_r_test_context_shift_size", (DL_FUNC) &r_test_context_shift_size, 4},
+  {"c_r_test_stop_matcher", (DL_FUNC) &r_test_stop_matcher, 2},
+  {"c_r_test_lookup_draft", (DL_FUNC) &r_test_lookup_draft, 3},
+  {"c_r_test_offsets_valid", (DL_FUNC) &r_test_offsets_valid, 2},
+  {"c_r_test_trace_sequence", (DL_FUNC) &r_test_trace_sequence, 5},
+  {"c_r_test_chat_kept_tokens", (DL_FUNC) &r_test_chat_kept_tokens, 4},
+  
   {NULL, NULL, 0}
 };
 
 // 包初始化函数
 extern "C" void R_init_newrllama4(DllInfo *dll) {
   R_registerRoutines(dll, NULL, CallEntries, NULL, NULL);
+  newrllama_altrep_init(dll);
   R_useDynamicSymbols(dll, TRUE);
   R_forceSymbols(dll, FALSE);
 } 
\ No newline at end of file
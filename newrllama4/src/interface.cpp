@@ -1,6 +1,11 @@
 #include <Rcpp.h>
+#include <R_ext/Altrep.h>
 #include "proxy.h"
+#include "newrllama_utils.h"
 #include <dlfcn.h>
+#include <sys/resource.h>
+#include <chrono>
+#include <cmath>
 
 using namespace Rcpp;
 
@@ -11,6 +16,271 @@ void check_error(newrllama_error_code code, const char* error_message) {
     }
 }
 
+// --- Helpers for converting backend reports into R lists ---
+// t_copy_ms is measured on the R side: converting the backend's strings into R vectors.
+static List perf_stats_to_list(const newrllama_perf_stats& st, double t_copy_ms) {
+    return List::create(
+        Named("n_slots") = st.n_slots,
+        Named("n_prompts") = st.n_prompts,
+        Named("n_prompt_tokens") = (double)st.n_prompt_tokens,
+        Named("n_reused_prompt_tokens") = (double)st.n_reused_prompt_tokens,
+        Named("n_generated_tokens") = (double)st.n_generated_tokens,
+        Named("n_decode_calls") = st.n_decode_calls,
+        Named("t_total_ms") = st.t_total_ms,
+        Named("t_prefill_ms") = st.t_prefill_ms,
+        Named("t_decode_ms") = st.t_decode_ms,
+        Named("t_sample_ms") = st.t_sample_ms,
+        Named("t_detokenize_ms") = st.t_detokenize_ms,
+        Named("t_copy_ms") = t_copy_ms,
+        Named("tokens_per_second") = st.tokens_per_second,
+        Named("avg_batch_fill") = st.avg_batch_fill,
+        Named("avg_slot_occupancy") = st.avg_slot_occupancy,
+        Named("n_kv_cells_used") = st.n_kv_cells_used,
+        Named("n_drafted_tokens") = (double)st.n_drafted_tokens,
+        Named("n_accepted_tokens") = (double)st.n_accepted_tokens,
+        Named("acceptance_rate") = st.n_drafted_tokens > 0 ? (double)st.n_accepted_tokens / st.n_drafted_tokens : NA_REAL,
+        Named("t_draft_ms") = st.t_draft_ms,
+        Named("n_context_shifts") = st.n_context_shifts);
+}
+
+// One row per generated token: token, logprob, and the n_probs-column matrices top_token and
+// top_logprob holding the most likely alternatives (the backend stores them row by row).
+static SEXP token_probs_to_df(const newrllama_token_probs& probs) {
+    const int n = (int)probs.n_tokens;
+    const int k = probs.n_probs;
+    SEXP token = PROTECT(Rf_allocVector(INTSXP, n));
+    SEXP logprob = PROTECT(Rf_allocVector(REALSXP, n));
+    SEXP top_token = PROTECT(Rf_allocMatrix(INTSXP, n, k));
+    SEXP top_logprob = PROTECT(Rf_allocMatrix(REALSXP, n, k));
+    std::copy(probs.token, probs.token + n, INTEGER(token));
+    std::copy(probs.logprob, probs.logprob + n, REAL(logprob));
+    for (int i = 0; i < n; ++i) {
+        for (int j = 0; j < k; ++j) {
+            INTEGER(top_token)[i + (size_t)j * n] = probs.top_token[(size_t)i * k + j];
+            REAL(top_logprob)[i + (size_t)j * n] = probs.top_logprob[(size_t)i * k + j];
+        }
+    }
+    List df = List::create(Named("token") = token, Named("logprob") = logprob,
+                           Named("top_token") = top_token, Named("top_logprob") = top_logprob);
+    df.attr("class") = "data.frame";
+    df.attr("row.names") = IntegerVector::create(NA_INTEGER, -n);
+    UNPROTECT(4);
+    return df;
+}
+
+static double ms_since(std::chrono::steady_clock::time_point t0) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+}
+
+// --- Detokenization into a reusable buffer ---
+// Text is written into a buffer kept across calls and copied once, into the CHARSXP.
+static std::vector<char> detokenize_buffer(256);
+
+static SEXP detokenize_to_charsxp(newrllama_model_handle model, const int* tokens, R_xlen_t n_tokens) {
+    size_t length = 0;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.detokenize_into(model, tokens, n_tokens, detokenize_buffer.data(), detokenize_buffer.size(), &length, &error_message), error_message);
+    if (length >= detokenize_buffer.size()) {
+        detokenize_buffer.resize(length + 1);
+        check_error(newrllama_api.detokenize_into(model, tokens, n_tokens, detokenize_buffer.data(), detokenize_buffer.size(), &length, &error_message), error_message);
+    }
+    return Rf_mkCharLenCE(detokenize_buffer.data(), (int)length, CE_UTF8);
+}
+
+// --- Tokenization into a reusable buffer ---
+// Tokens are written into a buffer kept across calls and copied once, into the INTSXP.
+static std::vector<int32_t> tokenize_buffer(256);
+
+static SEXP tokenize_to_intsxp(newrllama_model_handle model, const char* text, bool add_special) {
+    size_t n_tokens = 0;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.tokenize_into(model, text, add_special, tokenize_buffer.data(), tokenize_buffer.size(), &n_tokens, &error_message), error_message);
+    if (n_tokens > tokenize_buffer.size()) {
+        tokenize_buffer.resize(n_tokens);
+        check_error(newrllama_api.tokenize_into(model, text, add_special, tokenize_buffer.data(), tokenize_buffer.size(), &n_tokens, &error_message), error_message);
+    }
+    SEXP result = PROTECT(Rf_allocVector(INTSXP, (R_xlen_t)n_tokens));
+    std::memcpy(INTEGER(result), tokenize_buffer.data(), n_tokens * sizeof(int32_t));
+    UNPROTECT(1);
+    return result;
+}
+
+// --- Backend buffers exposed as ALTREP vectors ---
+// Batch results arrive as one backend allocation plus offsets. Instead of copying every element
+// into R, these vectors view the allocation in place: an integer view hands R the backend's
+// int32 memory as its data pointer, and a string view builds each CHARSXP only when the element
+// is read. The allocation is owned by an external pointer shared by all views into it and is
+// freed when the last of them is garbage collected.
+static R_altrep_class_t arena_integer_class;
+static R_altrep_class_t arena_string_class;
+
+struct string_arena {
+    char* text;
+    int64_t* offsets;
+    R_xlen_t n;
+};
+
+extern "C" void token_arena_finalizer(SEXP ptr) {
+    int32_t* tokens = static_cast<int32_t*>(R_ExternalPtrAddr(ptr));
+    if (tokens && newrllama_api.free_tokens) {
+        newrllama_api.free_tokens(tokens);
+    }
+    R_ClearExternalPtr(ptr);
+}
+
+extern "C" void string_arena_finalizer(SEXP ptr) {
+    string_arena* arena = static_cast<string_arena*>(R_ExternalPtrAddr(ptr));
+    if (arena) {
+        if (newrllama_api.free_string) newrllama_api.free_string(arena->text);
+        if (newrllama_api.free_offsets) newrllama_api.free_offsets(arena->offsets);
+        delete arena;
+    }
+    R_ClearExternalPtr(ptr);
+}
+
+// Takes ownership of a token buffer returned by the backend.
+static SEXP wrap_token_arena(int32_t* tokens) {
+    SEXP ptr = PROTECT(R_MakeExternalPtr(tokens, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(ptr, token_arena_finalizer, TRUE);
+    UNPROTECT(1);
+    return ptr;
+}
+
+// An integer vector over tokens[start, start + length) of an arena from wrap_token_arena.
+static SEXP token_view(SEXP arena, int64_t start, int64_t length) {
+    SEXP range = PROTECT(Rf_allocVector(REALSXP, 2));
+    REAL(range)[0] = (double)start;
+    REAL(range)[1] = (double)length;
+    SEXP result = R_new_altrep(arena_integer_class, arena, range);
+    UNPROTECT(1);
+    return result;
+}
+
+static int32_t* token_view_data(SEXP x) {
+    return static_cast<int32_t*>(R_ExternalPtrAddr(R_altrep_data1(x))) + (R_xlen_t)REAL(R_altrep_data2(x))[0];
+}
+
+static R_xlen_t token_view_length(SEXP x) {
+    return (R_xlen_t)REAL(R_altrep_data2(x))[1];
+}
+
+static int token_view_elt(SEXP x, R_xlen_t i) {
+    return token_view_data(x)[i];
+}
+
+static void* token_view_dataptr(SEXP x, Rboolean) {
+    return token_view_data(x);
+}
+
+static const void* token_view_dataptr_or_null(SEXP x) {
+    return token_view_data(x);
+}
+
+// Takes ownership of a text buffer and its n + 1 offsets returned by the backend.
+static SEXP string_view(char* text, int64_t* offsets, R_xlen_t n) {
+    SEXP ptr = PROTECT(R_MakeExternalPtr(new string_arena{text, offsets, n}, R_NilValue, R_NilValue));
+    R_RegisterCFinalizerEx(ptr, string_arena_finalizer, TRUE);
+    SEXP result = R_new_altrep(arena_string_class, ptr, R_NilValue);
+    UNPROTECT(1);
+    return result;
+}
+
+// data2 holds the fully materialized STRSXP once R has asked for a data pointer or assigned an
+// element; the arena is released at that point.
+static SEXP string_view_materialize(SEXP x) {
+    SEXP full = R_altrep_data2(x);
+    if (full != R_NilValue) return full;
+    SEXP ptr = R_altrep_data1(x);
+    const string_arena* arena = static_cast<const string_arena*>(R_ExternalPtrAddr(ptr));
+    full = PROTECT(Rf_allocVector(STRSXP, arena->n));
+    for (R_xlen_t i = 0; i < arena->n; ++i) {
+        SET_STRING_ELT(full, i, Rf_mkCharLenCE(arena->text + arena->offsets[i], (int)(arena->offsets[i + 1] - arena->offsets[i]), CE_UTF8));
+    }
+    R_set_altrep_data2(x, full);
+    string_arena_finalizer(ptr);
+    UNPROTECT(1);
+    return full;
+}
+
+static R_xlen_t string_view_length(SEXP x) {
+    SEXP full = R_altrep_data2(x);
+    if (full != R_NilValue) return XLENGTH(full);
+    return static_cast<const string_arena*>(R_ExternalPtrAddr(R_altrep_data1(x)))->n;
+}
+
+static SEXP string_view_elt(SEXP x, R_xlen_t i) {
+    SEXP full = R_altrep_data2(x);
+    if (full != R_NilValue) return STRING_ELT(full, i);
+    const string_arena* arena = static_cast<const string_arena*>(R_ExternalPtrAddr(R_altrep_data1(x)));
+    return Rf_mkCharLenCE(arena->text + arena->offsets[i], (int)(arena->offsets[i + 1] - arena->offsets[i]), CE_UTF8);
+}
+
+static void string_view_set_elt(SEXP x, R_xlen_t i, SEXP value) {
+    SET_STRING_ELT(string_view_materialize(x), i, value);
+}
+
+static void* string_view_dataptr(SEXP x, Rboolean) {
+    return (void*) STRING_PTR_RO(string_view_materialize(x));
+}
+
+static const void* string_view_dataptr_or_null(SEXP x) {
+    SEXP full = R_altrep_data2(x);
+    return full == R_NilValue ? nullptr : (const void*) STRING_PTR_RO(full);
+}
+
+extern "C" void newrllama_altrep_init(DllInfo* dll) {
+    arena_integer_class = R_make_altinteger_class("newrllama_tokens", "newrllama4", dll);
+    R_set_altrep_Length_method(arena_integer_class, token_view_length);
+    R_set_altinteger_Elt_method(arena_integer_class, token_view_elt);
+    R_set_altvec_Dataptr_method(arena_integer_class, token_view_dataptr);
+    R_set_altvec_Dataptr_or_null_method(arena_integer_class, token_view_dataptr_or_null);
+
+    arena_string_class = R_make_altstring_class("newrllama_strings", "newrllama4", dll);
+    R_set_altrep_Length_method(arena_string_class, string_view_length);
+    R_set_altstring_Elt_method(arena_string_class, string_view_elt);
+    R_set_altstring_Set_elt_method(arena_string_class, string_view_set_elt);
+    R_set_altvec_Dataptr_method(arena_string_class, string_view_dataptr);
+    R_set_altvec_Dataptr_or_null_method(arena_string_class, string_view_dataptr_or_null);
+}
+
+// --- Streaming callback trampoline ---
+// The backend calls this for every UTF-8-complete chunk. The R callback runs under
+// R_tryEval so an R error or interrupt cannot longjmp through the backend's frames;
+// it stops generation instead and is re-raised once the backend has returned.
+struct stream_callback_data {
+    SEXP fun;
+    bool failed;
+    std::string error;
+};
+
+static void check_interrupt_fn(void*) {
+    R_CheckUserInterrupt();
+}
+
+static bool stream_callback(const char* piece, size_t length, int32_t token, void* user_data) {
+    stream_callback_data* data = static_cast<stream_callback_data*>(user_data);
+    if (data->failed) return false;
+    SEXP chunk = PROTECT(Rf_allocVector(STRSXP, 1));
+    SET_STRING_ELT(chunk, 0, Rf_mkCharLenCE(piece, (int)length, CE_UTF8));
+    SEXP call = PROTECT(Rf_lang2(data->fun, chunk));
+    int error_occurred = 0;
+    SEXP res = R_tryEval(call, R_GlobalEnv, &error_occurred);
+    bool keep_going = true;
+    if (error_occurred) {
+        data->failed = true;
+        data->error = "Error in streaming callback.";
+        keep_going = false;
+    } else if (TYPEOF(res) == LGLSXP && LENGTH(res) == 1 && LOGICAL(res)[0] == FALSE) {
+        keep_going = false;
+    } else if (!R_ToplevelExec(check_interrupt_fn, nullptr)) {
+        data->failed = true;
+        data->error = "Generation interrupted by user.";
+        keep_going = false;
+    }
+    UNPROTECT(2);
+    return keep_going;
+}
+
 // --- Finalizers for External Pointers ---
 extern "C" void model_finalizer(SEXP ptr) {
     newrllama_model_handle handle = static_cast<newrllama_model_handle>(R_ExternalPtrAddr(ptr));
@@ -28,10 +298,139 @@ extern "C" void context_finalizer(SEXP ptr) {
     R_ClearExternalPtr(ptr);
 }
 
+extern "C" void job_finalizer(SEXP ptr) {
+    newrllama_job_handle handle = static_cast<newrllama_job_handle>(R_ExternalPtrAddr(ptr));
+    if (handle && newrllama_api.job_free) {
+        newrllama_api.job_free(handle);
+    }
+    R_ClearExternalPtr(ptr);
+}
+
+extern "C" void pool_finalizer(SEXP ptr) {
+    newrllama_pool_handle handle = static_cast<newrllama_pool_handle>(R_ExternalPtrAddr(ptr));
+    if (handle && newrllama_api.pool_free) {
+        newrllama_api.pool_free(handle);
+    }
+    R_ClearExternalPtr(ptr);
+}
+
+// --- Waiting on generation jobs ---
+static const char* job_state_name(newrllama_job_state state) {
+    switch (state) {
+        case NEWRLLAMA_JOB_RUNNING: return "running";
+        case NEWRLLAMA_JOB_DONE: return "done";
+        case NEWRLLAMA_JOB_FAILED: return "failed";
+        case NEWRLLAMA_JOB_CANCELLED: return "cancelled";
+    }
+    return "unknown";
+}
+
+// Waits in short slices so a user interrupt is noticed; timeout_s may be Inf.
+static newrllama_job_state wait_for_job(newrllama_job_handle job, double timeout_s, bool& interrupted) {
+    const auto t_start = std::chrono::steady_clock::now();
+    interrupted = false;
+    while (true) {
+        int slice_ms = 50;
+        if (std::isfinite(timeout_s)) {
+            const double remaining_ms = timeout_s * 1000.0 - ms_since(t_start);
+            if (remaining_ms <= 0) return newrllama_api.job_status(job);
+            slice_ms = (int)std::min(50.0, std::ceil(remaining_ms));
+        }
+        newrllama_job_state state = newrllama_api.job_wait(job, slice_ms);
+        if (state != NEWRLLAMA_JOB_RUNNING) return state;
+        if (!R_ToplevelExec(check_interrupt_fn, nullptr)) {
+            interrupted = true;
+            return state;
+        }
+    }
+}
+
+// Converts a finished job's outputs into a character vector, optionally releasing the job.
+// With return_probs, the "logprobs" attribute is a list of data frames, one per result.
+static SEXP collect_job(newrllama_job_handle job, bool return_stats, bool free_job, bool return_probs = false) {
+    char* text_c = nullptr;
+    int64_t* offsets_c = nullptr;
+    int n_results = 0;
+    struct newrllama_perf_stats stats = {};
+    const char* error_message = nullptr;
+    newrllama_error_code code = newrllama_api.job_result_arena(job, &text_c, &offsets_c, &n_results, &stats, &error_message);
+    const std::string error = error_message ? error_message : "An unknown error occurred in the backend C-API.";
+    List probs_r(return_probs && code == NEWRLLAMA_SUCCESS ? n_results : 0);
+    for (int i = 0; i < probs_r.size(); ++i) {
+        struct newrllama_token_probs probs = {};
+        if (newrllama_api.job_token_probs(job, i, &probs, &error_message) == NEWRLLAMA_SUCCESS) {
+            probs_r[i] = token_probs_to_df(probs);
+            newrllama_api.free_token_probs(&probs);
+        }
+    }
+    if (free_job) {
+        newrllama_api.job_free(job);
+    }
+    if (code != NEWRLLAMA_SUCCESS) {
+        stop(error);
+    }
+    const auto t_copy = std::chrono::steady_clock::now();
+    SEXP results_r = PROTECT(string_view(text_c, offsets_c, n_results));
+    if (return_stats) {
+        Rf_setAttrib(results_r, Rf_install("stats"), perf_stats_to_list(stats, ms_since(t_copy)));
+    }
+    if (return_probs) {
+        Rf_setAttrib(results_r, Rf_install("logprobs"), probs_r);
+    }
+    UNPROTECT(1);
+    return results_r;
+}
+
+// Waits for a job that a blocking call started: Ctrl-C cancels the job at its next decode step.
+static void finish_job(newrllama_job_handle job) {
+    bool interrupted = false;
+    wait_for_job(job, R_PosInf, interrupted);
+    if (interrupted) {
+        newrllama_api.job_cancel(job);
+        newrllama_api.job_free(job);
+        stop("Generation interrupted by user.");
+    }
+}
+
+static SEXP run_job(newrllama_job_handle job, bool return_stats, bool return_probs = false) {
+    finish_job(job);
+    return collect_job(job, return_stats, true, return_probs);
+}
+
 // ------------------------------------
 // --- R-Exported Wrapper Functions ---
 // ------------------------------------
 
+// --- Context settings ---
+// Starts from the backend defaults and overrides the fields present (and not NULL) in `params`.
+static struct newrllama_context_params context_params_from_list(SEXP params) {
+    struct newrllama_context_params out = newrllama_api.context_default_params();
+    List list(params);
+    auto has = [&list](const char* name) { return list.containsElementNamed(name) && !Rf_isNull(list[name]); };
+    if (has("n_ctx")) out.n_ctx = as<int>(list["n_ctx"]);
+    if (has("n_threads")) out.n_threads = as<int>(list["n_threads"]);
+    if (has("n_threads_batch")) out.n_threads_batch = as<int>(list["n_threads_batch"]);
+    if (has("n_seq_max")) out.n_seq_max = as<int>(list["n_seq_max"]);
+    if (has("n_batch")) out.n_batch = as<int>(list["n_batch"]);
+    if (has("n_ubatch")) out.n_ubatch = as<int>(list["n_ubatch"]);
+    if (has("embeddings")) out.embeddings = as<bool>(list["embeddings"]);
+    if (has("pooling_type")) out.pooling_type = as<int>(list["pooling_type"]);
+    if (has("flash_attn")) out.flash_attn = as<bool>(list["flash_attn"]);
+    if (has("type_k")) out.type_k = as<int>(list["type_k"]);
+    if (has("type_v")) out.type_v = as<int>(list["type_v"]);
+    if (has("offload_kqv")) out.offload_kqv = as<bool>(list["offload_kqv"]);
+    if (has("rope_scaling_type")) out.rope_scaling_type = as<int>(list["rope_scaling_type"]);
+    if (has("rope_freq_base")) out.rope_freq_base = as<float>(list["rope_freq_base"]);
+    if (has("rope_freq_scale")) out.rope_freq_scale = as<float>(list["rope_freq_scale"]);
+    if (has("yarn_orig_ctx")) out.yarn_orig_ctx = as<int>(list["yarn_orig_ctx"]);
+    if (has("defrag_thold")) out.defrag_thold = as<float>(list["defrag_thold"]);
+    if (has("lookup_n_draft")) out.lookup_n_draft = as<int>(list["lookup_n_draft"]);
+    if (has("lookup_ngram_max")) out.lookup_ngram_max = as<int>(list["lookup_ngram_max"]);
+    if (has("ctx_shift")) out.ctx_shift = as<bool>(list["ctx_shift"]);
+    if (has("n_keep")) out.n_keep = as<int>(list["n_keep"]);
+    return out;
+}
+
 extern "C" {
 
 void r_newrllama_api_init(SEXP path_sexp) {
@@ -71,6 +470,33 @@ SEXP r_backend_init() {
     return R_NilValue;
 }
 
+SEXP r_cpu_info() {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    char* variant_c = nullptr;
+    char* features_c = nullptr;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.cpu_info(&variant_c, &features_c, &error_message), error_message);
+    std::string variant(variant_c);
+    std::string features_str(features_c);
+    newrllama_api.free_string(variant_c);
+    newrllama_api.free_string(features_c);
+    std::vector<std::string> parts;
+    size_t start = 0;
+    while (start < features_str.size()) {
+        size_t comma = features_str.find(',', start);
+        if (comma == std::string::npos) comma = features_str.size();
+        parts.push_back(features_str.substr(start, comma - start));
+        start = comma + 1;
+    }
+    CharacterVector features((int)parts.size());
+    for (size_t i = 0; i < parts.size(); ++i) {
+        features[(int)i] = parts[i];
+    }
+    return List::create(Named("variant") = variant, Named("features") = features);
+}
+
 SEXP r_backend_free() {
     if (newrllama_api.backend_free) {
         newrllama_api.backend_free();
@@ -99,17 +525,42 @@ SEXP r_model_load(SEXP model_path, SEXP n_gpu_layers, SEXP use_mmap, SEXP use_ml
     return p;
 }
 
-SEXP r_context_create(SEXP model_ptr, SEXP n_ctx, SEXP n_threads, SEXP n_seq_max) {
+SEXP r_model_cache_policy(SEXP max_idle, SEXP idle_timeout) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    double idle_timeout_dbl = as<double>(idle_timeout);
+    newrllama_api.model_cache_set_policy(as<int>(max_idle), std::isfinite(idle_timeout_dbl) ? idle_timeout_dbl : -1.0);
+    return R_NilValue;
+}
+
+SEXP r_model_cache_clear() {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_api.model_cache_clear();
+    return R_NilValue;
+}
+
+SEXP r_model_cache_info() {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    int n_models = 0;
+    int n_idle = 0;
+    newrllama_api.model_cache_info(&n_models, &n_idle);
+    return List::create(Named("n_models") = n_models, Named("n_idle") = n_idle);
+}
+
+SEXP r_context_create(SEXP model_ptr, SEXP params) {
     if (!newrllama_api_is_loaded()) {
         stop("Backend library is not loaded. Please run install_newrllama() first.");
     }
     newrllama_model_handle model = static_cast<newrllama_model_handle>(R_ExternalPtrAddr(model_ptr));
-    int n_ctx_int = as<int>(n_ctx);
-    int n_threads_int = as<int>(n_threads);
-    int n_seq_max_int = as<int>(n_seq_max);
+    struct newrllama_context_params params_c = context_params_from_list(params);
     const char* error_message = nullptr;
     newrllama_context_handle handle = nullptr;
-    check_error(newrllama_api.context_create(model, n_ctx_int, n_threads_int, n_seq_max_int, &handle, &error_message), error_message);
+    check_error(newrllama_api.context_create_ext(model, &params_c, &handle, &error_message), error_message);
     
     SEXP p = R_MakeExternalPtr(handle, R_NilValue, R_NilValue);
     PROTECT(p);
@@ -119,31 +570,68 @@ SEXP r_context_create(SEXP model_ptr, SEXP n_ctx, SEXP n_threads, SEXP n_seq_max
     return p;
 }
 
+SEXP r_kv_cache_clear(SEXP ctx_ptr) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    newrllama_api.kv_cache_clear(ctx);
+    return R_NilValue;
+}
+
 SEXP r_tokenize(SEXP model_ptr, SEXP text, SEXP add_special) {
     if (!newrllama_api_is_loaded()) {
         stop("Backend library is not loaded. Please run install_newrllama() first.");
     }
     
     newrllama_model_handle model = static_cast<newrllama_model_handle>(R_ExternalPtrAddr(model_ptr));
-    std::string text_str = as<std::string>(text);
+    CharacterVector text_vec = as<CharacterVector>(text);
+    if (text_vec.size() != 1) {
+        stop("text must be a single string.");
+    }
+    return tokenize_to_intsxp(model, CHAR(STRING_ELT(text_vec, 0)), as<bool>(add_special));
+}
+
+SEXP r_tokenize_batch(SEXP model_ptr, SEXP texts, SEXP add_special, SEXP n_threads, SEXP flat) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_model_handle model = static_cast<newrllama_model_handle>(R_ExternalPtrAddr(model_ptr));
+    CharacterVector texts_vec = as<CharacterVector>(texts);
     bool add_special_bool = as<bool>(add_special);
-    
-    alignas(8) const char* error_message = nullptr;
-    alignas(8) int32_t* tokens_c = nullptr;
-    alignas(8) size_t n_tokens_c = 0;
-    
-    newrllama_error_code result = newrllama_api.tokenize(model, text_str.c_str(), add_special_bool, &tokens_c, &n_tokens_c, &error_message);
-    check_error(result, error_message);
-    
-    IntegerVector tokens_r(n_tokens_c);
-    for (size_t i = 0; i < n_tokens_c; ++i) {
-        tokens_r[i] = tokens_c[i];
+    int n_threads_int = as<int>(n_threads);
+    bool flat_bool = as<bool>(flat);
+    // CHAR pointers stay valid while texts_vec is alive, so the workers read R's strings in place.
+    std::vector<const char*> texts_c(texts_vec.size());
+    for (int i = 0; i < texts_vec.size(); ++i) {
+        texts_c[i] = CHAR(STRING_ELT(texts_vec, i));
     }
-    
-    if (newrllama_api.free_tokens) {
-        newrllama_api.free_tokens(tokens_c);
+    int32_t* tokens_c = nullptr;
+    int64_t* offsets_c = nullptr;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.tokenize_batch(model, texts_c.data(), texts_c.size(), add_special_bool, n_threads_int, &tokens_c, &offsets_c, &error_message), error_message);
+    const size_t n_texts = texts_c.size();
+    // The token buffer becomes the data of the returned vectors; only the offsets are copied.
+    SEXP arena = PROTECT(wrap_token_arena(tokens_c));
+    SEXP result;
+    if (flat_bool) {
+        result = PROTECT(token_view(arena, 0, offsets_c[n_texts]));
+        SEXP offsets_r = PROTECT(Rf_allocVector(REALSXP, n_texts + 1));
+        double* offsets_out = REAL(offsets_r);
+        for (size_t i = 0; i <= n_texts; ++i) {
+            offsets_out[i] = (double)offsets_c[i];
+        }
+        Rf_setAttrib(result, Rf_install("offsets"), offsets_r);
+        UNPROTECT(1);
+    } else {
+        result = PROTECT(Rf_allocVector(VECSXP, n_texts));
+        for (size_t i = 0; i < n_texts; ++i) {
+            SET_VECTOR_ELT(result, i, token_view(arena, offsets_c[i], offsets_c[i + 1] - offsets_c[i]));
+        }
     }
-    return tokens_r;
+    newrllama_api.free_offsets(offsets_c);
+    UNPROTECT(2);
+    return result;
 }
 
 SEXP r_detokenize(SEXP model_ptr, SEXP tokens) {
@@ -152,15 +640,46 @@ SEXP r_detokenize(SEXP model_ptr, SEXP tokens) {
     }
     newrllama_model_handle model = static_cast<newrllama_model_handle>(R_ExternalPtrAddr(model_ptr));
     IntegerVector tokens_vec = as<IntegerVector>(tokens);
-    const char* error_message = nullptr;
-    char* text_c = nullptr;
-    std::vector<int32_t> tokens_cpp = as<std::vector<int32_t>>(tokens_vec);
-    check_error(newrllama_api.detokenize(model, tokens_cpp.data(), tokens_cpp.size(), &text_c, &error_message), error_message);
-    std::string result(text_c);
-    if (newrllama_api.free_string) {
-        newrllama_api.free_string(text_c);
+    SEXP text = PROTECT(detokenize_to_charsxp(model, INTEGER(tokens_vec), tokens_vec.size()));
+    SEXP result = PROTECT(Rf_ScalarString(text));
+    UNPROTECT(2);
+    return result;
+}
+
+SEXP r_detokenize_batch(SEXP model_ptr, SEXP tokens) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
     }
-    return CharacterVector::create(result);
+    newrllama_model_handle model = static_cast<newrllama_model_handle>(R_ExternalPtrAddr(model_ptr));
+    SEXP result;
+    if (TYPEOF(tokens) == VECSXP) {
+        // A list of token vectors: each element is read in place, no flattening copy.
+        const R_xlen_t n_seqs = Rf_xlength(tokens);
+        result = PROTECT(Rf_allocVector(STRSXP, n_seqs));
+        for (R_xlen_t i = 0; i < n_seqs; ++i) {
+            SEXP seq = VECTOR_ELT(tokens, i);
+            if (TYPEOF(seq) != INTSXP) {
+                stop("Every element of tokens must be an integer vector.");
+            }
+            SET_STRING_ELT(result, i, detokenize_to_charsxp(model, INTEGER(seq), Rf_xlength(seq)));
+        }
+    } else {
+        // A flat vector with CSR offsets, as returned by tokenize_batch(flat = TRUE).
+        IntegerVector tokens_vec = as<IntegerVector>(tokens);
+        NumericVector offsets_r = as<NumericVector>(Rf_getAttrib(tokens, Rf_install("offsets")));
+        if (offsets_r.size() < 1 || !offsets_valid(REAL(offsets_r), offsets_r.size() - 1, (double)tokens_vec.size())) {
+            stop("tokens needs a valid \"offsets\" attribute: non-decreasing, from 0 up to length(tokens).");
+        }
+        const int n_seqs = offsets_r.size() - 1;
+        std::vector<int64_t> offsets_c(offsets_r.begin(), offsets_r.end());
+        char* text_c = nullptr;
+        int64_t* text_offsets = nullptr;
+        const char* error_message = nullptr;
+        check_error(newrllama_api.detokenize_batch(model, INTEGER(tokens_vec), offsets_c.data(), n_seqs, &text_c, &text_offsets, &error_message), error_message);
+        result = PROTECT(string_view(text_c, text_offsets, n_seqs));
+    }
+    UNPROTECT(1);
+    return result;
 }
 
 SEXP r_apply_chat_template(SEXP model_ptr, SEXP tmpl, SEXP chat_messages, SEXP add_ass) {
@@ -197,13 +716,46 @@ SEXP r_apply_chat_template(SEXP model_ptr, SEXP tmpl, SEXP chat_messages, SEXP a
     return CharacterVector::create(result);
 }
 
-SEXP r_generate(SEXP ctx_ptr, SEXP tokens, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed) {
+// GBNF grammar from R: NULL for none. The string belongs to R and is only borrowed for the call.
+static const char* grammar_from_sexp(SEXP grammar) {
+    return Rf_isNull(grammar) ? nullptr : CHAR(STRING_ELT(grammar, 0));
+}
+
+// Sampling settings on top of the backend's defaults, so fields added later keep their defaults.
+static struct newrllama_sampling_params sampling_params(int max_tokens, int top_k, float top_p, float temperature, int repeat_last_n, float penalty_repeat, int32_t seed, const char* grammar = nullptr, int n_probs = 0, const std::vector<const char*>* stop = nullptr) {
+    struct newrllama_sampling_params params = newrllama_api.sampling_default_params();
+    params.max_tokens = max_tokens;
+    params.top_k = top_k;
+    params.top_p = top_p;
+    params.temperature = temperature;
+    params.repeat_last_n = repeat_last_n;
+    params.penalty_repeat = penalty_repeat;
+    params.seed = seed;
+    params.grammar = grammar;
+    params.n_probs = n_probs;
+    if (stop) {
+        params.stop = stop->data();
+        params.n_stop = (int)stop->size();
+    }
+    return params;
+}
+
+// Stop strings from R: NULL or a character vector, NA entries ignored. The strings belong to R
+// and are only borrowed for the call.
+static std::vector<const char*> stop_from_sexp(SEXP stop_strings) {
+    std::vector<const char*> out;
+    for (R_xlen_t i = 0; !Rf_isNull(stop_strings) && i < Rf_xlength(stop_strings); ++i) {
+        if (STRING_ELT(stop_strings, i) != NA_STRING) out.push_back(CHAR(STRING_ELT(stop_strings, i)));
+    }
+    return out;
+}
+
+SEXP r_generate(SEXP ctx_ptr, SEXP tokens, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed, SEXP return_stats, SEXP draft_ptr, SEXP n_draft, SEXP grammar, SEXP n_probs, SEXP stop_strings) {
     if (!newrllama_api_is_loaded()) {
         stop("Backend library is not loaded. Please run install_newrllama() first.");
     }
     newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
     IntegerVector tokens_vec = as<IntegerVector>(tokens);
-    std::vector<int32_t> tokens_cpp = as<std::vector<int32_t>>(tokens_vec);
     int max_tokens_int = as<int>(max_tokens);
     int top_k_int = as<int>(top_k);
     float top_p_float = as<float>(top_p);
@@ -211,22 +763,28 @@ SEXP r_generate(SEXP ctx_ptr, SEXP tokens, SEXP max_tokens, SEXP top_k, SEXP top
     int repeat_last_n_int = as<int>(repeat_last_n);
     float penalty_repeat_float = as<float>(penalty_repeat);
     int32_t seed_int = as<int32_t>(seed);
-    char* result_c = nullptr;
+    bool return_stats_bool = as<bool>(return_stats);
+    // Run as a job so the R thread can react to Ctrl-C while the backend decodes.
+    int n_probs_int = as<int>(n_probs);
+    const std::vector<const char*> stop_c = stop_from_sexp(stop_strings);
+    struct newrllama_sampling_params params = sampling_params(max_tokens_int, top_k_int, top_p_float, temperature_float, repeat_last_n_int, penalty_repeat_float, seed_int, grammar_from_sexp(grammar), n_probs_int, &stop_c);
+    newrllama_job_handle job = nullptr;
     const char* error_message = nullptr;
-    check_error(newrllama_api.generate(ctx, tokens_cpp.data(), tokens_cpp.size(), max_tokens_int, top_k_int, top_p_float, temperature_float, repeat_last_n_int, penalty_repeat_float, seed_int, &result_c, &error_message), error_message);
-    std::string result(result_c);
-    if (newrllama_api.free_string) {
-        newrllama_api.free_string(result_c);
+    if (Rf_isNull(draft_ptr)) {
+        check_error(newrllama_api.generate_ext_async(ctx, INTEGER(tokens_vec), tokens_vec.size(), &params, &job, &error_message), error_message);
+    } else {
+        newrllama_context_handle draft_ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(draft_ptr));
+        check_error(newrllama_api.generate_speculative_async(ctx, draft_ctx, INTEGER(tokens_vec), tokens_vec.size(), &params, as<int>(n_draft), &job, &error_message), error_message);
     }
-    return CharacterVector::create(result);
+    return run_job(job, return_stats_bool, n_probs_int > 0);
 }
 
-SEXP r_generate_parallel(SEXP ctx_ptr, SEXP prompts, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed) {
+SEXP r_generate_stream(SEXP ctx_ptr, SEXP tokens, SEXP callback, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed, SEXP grammar, SEXP stop_strings) {
     if (!newrllama_api_is_loaded()) {
         stop("Backend library is not loaded. Please run install_newrllama() first.");
     }
     newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
-    CharacterVector prompts_vec = as<CharacterVector>(prompts);
+    IntegerVector tokens_vec = as<IntegerVector>(tokens);
     int max_tokens_int = as<int>(max_tokens);
     int top_k_int = as<int>(top_k);
     float top_p_float = as<float>(top_p);
@@ -234,25 +792,470 @@ SEXP r_generate_parallel(SEXP ctx_ptr, SEXP prompts, SEXP max_tokens, SEXP top_k
     int repeat_last_n_int = as<int>(repeat_last_n);
     float penalty_repeat_float = as<float>(penalty_repeat);
     int32_t seed_int = as<int32_t>(seed);
+    const std::vector<const char*> stop_c = stop_from_sexp(stop_strings);
+    struct newrllama_sampling_params params = sampling_params(max_tokens_int, top_k_int, top_p_float, temperature_float, repeat_last_n_int, penalty_repeat_float, seed_int, grammar_from_sexp(grammar), 0, &stop_c);
+    stream_callback_data data = {callback, false, std::string()};
+    char* result_c = nullptr;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.generate_ext(ctx, INTEGER(tokens_vec), tokens_vec.size(), &params, stream_callback, &data, &result_c, nullptr, nullptr, &error_message), error_message);
+    std::string result(result_c);
+    if (newrllama_api.free_string) {
+        newrllama_api.free_string(result_c);
+    }
+    if (data.failed) {
+        stop(data.error);
+    }
+    return CharacterVector::create(result);
+}
+
+// Sampling arguments may have length 1 (shared by all prompts) or one value per prompt; a
+// per-prompt grammar vector uses NA for prompts without one. The stop strings apply to every prompt.
+SEXP r_generate_parallel(SEXP ctx_ptr, SEXP prompts, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed, SEXP return_stats, SEXP grammar, SEXP n_probs, SEXP stop_strings) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    CharacterVector prompts_vec = as<CharacterVector>(prompts);
+    const int n_prompts = prompts_vec.size();
+    bool return_stats_bool = as<bool>(return_stats);
     
     std::vector<const char*> prompts_c;
     for(int i = 0; i < prompts_vec.size(); ++i) {
         prompts_c.push_back(CHAR(STRING_ELT(prompts_vec, i)));
     }
     
-    struct newrllama_parallel_params params = {max_tokens_int, top_k_int, top_p_float, temperature_float, repeat_last_n_int, penalty_repeat_float, seed_int};
-    char** results_c = nullptr;
+    const SEXP per_prompt[] = {max_tokens, top_k, top_p, temperature, repeat_last_n, penalty_repeat, seed, grammar, n_probs};
+    int n_params = 1;
+    for (SEXP arg : per_prompt) {
+        const R_xlen_t n = Rf_xlength(arg);
+        if (Rf_isNull(arg)) continue;
+        if (n != 1 && (n == 0 || n != n_prompts)) {
+            stop("Sampling arguments must have length 1 or the number of prompts.");
+        }
+        if (n > 1) n_params = n_prompts;
+    }
+    auto at = [](SEXP arg, int i) { return Rf_xlength(arg) > 1 ? i : 0; };
+    const std::vector<const char*> stop_c = stop_from_sexp(stop_strings);
+    std::vector<struct newrllama_sampling_params> params(n_params);
+    bool any_probs = false;
+    for (int i = 0; i < n_params; ++i) {
+        const char* grammar_c = nullptr;
+        if (!Rf_isNull(grammar) && STRING_ELT(grammar, at(grammar, i)) != NA_STRING) {
+            grammar_c = CHAR(STRING_ELT(grammar, at(grammar, i)));
+        }
+        params[i] = sampling_params(INTEGER(max_tokens)[at(max_tokens, i)], INTEGER(top_k)[at(top_k, i)],
+                                    (float)REAL(top_p)[at(top_p, i)], (float)REAL(temperature)[at(temperature, i)],
+                                    INTEGER(repeat_last_n)[at(repeat_last_n, i)], (float)REAL(penalty_repeat)[at(penalty_repeat, i)],
+                                    INTEGER(seed)[at(seed, i)], grammar_c, INTEGER(n_probs)[at(n_probs, i)], &stop_c);
+        any_probs = any_probs || params[i].n_probs > 0;
+    }
+    newrllama_job_handle job = nullptr;
     const char* error_message = nullptr;
-    check_error(newrllama_api.generate_parallel(ctx, prompts_c.data(), prompts_c.size(), &params, &results_c, &error_message), error_message);
-    
-    CharacterVector results_r(prompts_c.size());
-    for(size_t i = 0; i < prompts_c.size(); ++i) {
-        results_r[i] = std::string(results_c[i]);
+    check_error(newrllama_api.generate_parallel_ext_async(ctx, prompts_c.data(), prompts_c.size(), params.data(), n_params, &job, &error_message), error_message);
+    return run_job(job, return_stats_bool, any_probs);
+}
+
+SEXP r_json_schema_to_grammar(SEXP schema) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    std::string schema_str = as<std::string>(schema);
+    char* grammar_c = nullptr;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.json_schema_to_grammar(schema_str.c_str(), &grammar_c, &error_message), error_message);
+    std::string grammar(grammar_c);
+    newrllama_api.free_string(grammar_c);
+    return CharacterVector::create(grammar);
+}
+
+// --- Prompt scoring ---
+// One row per pair: the continuation's total log-likelihood, its token count and a list column
+// of per-token log-probabilities.
+SEXP r_score(SEXP ctx_ptr, SEXP prompts, SEXP continuations, SEXP return_stats) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
     }
-    if (newrllama_api.free_string_array) {
-        newrllama_api.free_string_array(results_c, prompts_c.size());
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    CharacterVector prompts_vec = as<CharacterVector>(prompts);
+    CharacterVector continuations_vec = as<CharacterVector>(continuations);
+    if (prompts_vec.size() != continuations_vec.size()) {
+        stop("prompts and continuations must have the same length.");
     }
-    return results_r;
+    const int n_pairs = prompts_vec.size();
+    std::vector<const char*> prompts_c(n_pairs), continuations_c(n_pairs);
+    for (int i = 0; i < n_pairs; ++i) {
+        prompts_c[i] = CHAR(STRING_ELT(prompts_vec, i));
+        continuations_c[i] = CHAR(STRING_ELT(continuations_vec, i));
+    }
+    newrllama_job_handle job = nullptr;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.score_async(ctx, prompts_c.data(), continuations_c.data(), n_pairs, &job, &error_message), error_message);
+    finish_job(job);
+    struct newrllama_scores scores = {};
+    struct newrllama_perf_stats stats = {};
+    newrllama_error_code code = newrllama_api.job_scores(job, &scores, &stats, &error_message);
+    const std::string error = error_message ? error_message : "An unknown error occurred in the backend C-API.";
+    newrllama_api.job_free(job);
+    if (code != NEWRLLAMA_SUCCESS) {
+        stop(error);
+    }
+    const auto t_copy = std::chrono::steady_clock::now();
+    SEXP logprob = PROTECT(Rf_allocVector(REALSXP, n_pairs));
+    SEXP n_tokens = PROTECT(Rf_allocVector(INTSXP, n_pairs));
+    SEXP token_logprobs = PROTECT(Rf_allocVector(VECSXP, n_pairs));
+    for (int i = 0; i < n_pairs; ++i) {
+        const int64_t begin = scores.offsets[i];
+        const int64_t end = scores.offsets[i + 1];
+        REAL(logprob)[i] = scores.logprob[i];
+        INTEGER(n_tokens)[i] = (int)(end - begin);
+        SEXP values = Rf_allocVector(REALSXP, (R_xlen_t)(end - begin));
+        SET_VECTOR_ELT(token_logprobs, i, values);
+        std::copy(scores.token_logprob + begin, scores.token_logprob + end, REAL(values));
+    }
+    newrllama_api.free_scores(&scores);
+    List df = List::create(Named("logprob") = logprob, Named("n_tokens") = n_tokens,
+                           Named("token_logprobs") = token_logprobs);
+    df.attr("class") = "data.frame";
+    df.attr("row.names") = IntegerVector::create(NA_INTEGER, -n_pairs);
+    if (as<bool>(return_stats)) {
+        df.attr("stats") = perf_stats_to_list(stats, ms_since(t_copy));
+    }
+    UNPROTECT(3);
+    return df;
+}
+
+// --- Generation jobs ---
+
+static newrllama_job_handle job_from_ptr(SEXP job_ptr) {
+    newrllama_job_handle job = static_cast<newrllama_job_handle>(R_ExternalPtrAddr(job_ptr));
+    if (!job) {
+        stop("Job handle has been released.");
+    }
+    return job;
+}
+
+static SEXP wrap_job(newrllama_job_handle job, SEXP ctx_ptr) {
+    // The context (or pool) is kept as the pointer's protected value so it outlives the job.
+    SEXP p = PROTECT(R_MakeExternalPtr(job, R_NilValue, ctx_ptr));
+    Rf_setAttrib(p, R_ClassSymbol, Rf_mkString("newrllama_job"));
+    R_RegisterCFinalizerEx(p, (R_CFinalizer_t)job_finalizer, TRUE);
+    UNPROTECT(1);
+    return p;
+}
+
+SEXP r_generate_async(SEXP ctx_ptr, SEXP tokens, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    IntegerVector tokens_vec = as<IntegerVector>(tokens);
+    newrllama_job_handle job = nullptr;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.generate_async(ctx, INTEGER(tokens_vec), tokens_vec.size(), as<int>(max_tokens), as<int>(top_k), as<float>(top_p), as<float>(temperature), as<int>(repeat_last_n), as<float>(penalty_repeat), as<int32_t>(seed), &job, &error_message), error_message);
+    return wrap_job(job, ctx_ptr);
+}
+
+SEXP r_generate_parallel_async(SEXP ctx_ptr, SEXP prompts, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    CharacterVector prompts_vec = as<CharacterVector>(prompts);
+    // The backend copies the prompts before returning, so R's strings are not needed afterwards.
+    std::vector<const char*> prompts_c(prompts_vec.size());
+    for (int i = 0; i < prompts_vec.size(); ++i) {
+        prompts_c[i] = CHAR(STRING_ELT(prompts_vec, i));
+    }
+    struct newrllama_sampling_params params = sampling_params(as<int>(max_tokens), as<int>(top_k), as<float>(top_p), as<float>(temperature), as<int>(repeat_last_n), as<float>(penalty_repeat), as<int32_t>(seed));
+    newrllama_job_handle job = nullptr;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.generate_parallel_async(ctx, prompts_c.data(), prompts_c.size(), &params, &job, &error_message), error_message);
+    return wrap_job(job, ctx_ptr);
+}
+
+SEXP r_job_status(SEXP job_ptr) {
+    return Rf_mkString(job_state_name(newrllama_api.job_status(job_from_ptr(job_ptr))));
+}
+
+SEXP r_job_wait(SEXP job_ptr, SEXP timeout) {
+    newrllama_job_handle job = job_from_ptr(job_ptr);
+    bool interrupted = false;
+    newrllama_job_state state = wait_for_job(job, as<double>(timeout), interrupted);
+    if (interrupted) {
+        stop("Wait interrupted; the job is still running.");
+    }
+    return Rf_mkString(job_state_name(state));
+}
+
+SEXP r_job_cancel(SEXP job_ptr) {
+    newrllama_api.job_cancel(job_from_ptr(job_ptr));
+    return R_NilValue;
+}
+
+SEXP r_job_result(SEXP job_ptr, SEXP return_stats) {
+    newrllama_job_handle job = job_from_ptr(job_ptr);
+    bool interrupted = false;
+    wait_for_job(job, R_PosInf, interrupted);
+    if (interrupted) {
+        stop("Wait interrupted; the job is still running.");
+    }
+    return collect_job(job, as<bool>(return_stats), false);
+}
+
+// --- Context pools ---
+
+SEXP r_pool_create(SEXP model_ptr, SEXP n_contexts, SEXP params) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_model_handle model = static_cast<newrllama_model_handle>(R_ExternalPtrAddr(model_ptr));
+    struct newrllama_context_params params_c = context_params_from_list(params);
+    const char* error_message = nullptr;
+    newrllama_pool_handle handle = nullptr;
+    check_error(newrllama_api.pool_create(model, as<int>(n_contexts), &params_c, &handle, &error_message), error_message);
+
+    SEXP p = R_MakeExternalPtr(handle, R_NilValue, R_NilValue);
+    PROTECT(p);
+    Rf_setAttrib(p, R_ClassSymbol, Rf_mkString("newrllama_pool"));
+    R_RegisterCFinalizerEx(p, (R_CFinalizer_t)pool_finalizer, TRUE);
+    UNPROTECT(1);
+    return p;
+}
+
+SEXP r_pool_generate_async(SEXP pool_ptr, SEXP tokens, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_pool_handle pool = static_cast<newrllama_pool_handle>(R_ExternalPtrAddr(pool_ptr));
+    IntegerVector tokens_vec = as<IntegerVector>(tokens);
+    newrllama_job_handle job = nullptr;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.pool_generate_async(pool, INTEGER(tokens_vec), tokens_vec.size(), as<int>(max_tokens), as<int>(top_k), as<float>(top_p), as<float>(temperature), as<int>(repeat_last_n), as<float>(penalty_repeat), as<int32_t>(seed), &job, &error_message), error_message);
+    return wrap_job(job, pool_ptr);
+}
+
+SEXP r_pool_generate(SEXP pool_ptr, SEXP tokens, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed, SEXP return_stats) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_pool_handle pool = static_cast<newrllama_pool_handle>(R_ExternalPtrAddr(pool_ptr));
+    IntegerVector tokens_vec = as<IntegerVector>(tokens);
+    // Waiting for a lease happens on the job thread, so Ctrl-C also leaves the queue.
+    newrllama_job_handle job = nullptr;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.pool_generate_async(pool, INTEGER(tokens_vec), tokens_vec.size(), as<int>(max_tokens), as<int>(top_k), as<float>(top_p), as<float>(temperature), as<int>(repeat_last_n), as<float>(penalty_repeat), as<int32_t>(seed), &job, &error_message), error_message);
+    return run_job(job, as<bool>(return_stats));
+}
+
+SEXP r_pool_info(SEXP pool_ptr) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_pool_handle pool = static_cast<newrllama_pool_handle>(R_ExternalPtrAddr(pool_ptr));
+    int n_leases = 0;
+    int n_busy = 0;
+    int n_waiting = 0;
+    newrllama_api.pool_info(pool, &n_leases, &n_busy, &n_waiting);
+    return List::create(Named("n_leases") = n_leases, Named("n_busy") = n_busy, Named("n_waiting") = n_waiting);
+}
+
+// --- Chat sessions ---
+
+extern "C" void chat_finalizer(SEXP ptr) {
+    newrllama_chat_handle handle = static_cast<newrllama_chat_handle>(R_ExternalPtrAddr(ptr));
+    if (handle && newrllama_api.chat_free) {
+        newrllama_api.chat_free(handle);
+    }
+    R_ClearExternalPtr(ptr);
+}
+
+SEXP r_chat_create(SEXP ctx_ptr, SEXP seq_id, SEXP tmpl, SEXP system_prompt) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    const char* tmpl_c = Rf_isNull(tmpl) ? nullptr : CHAR(STRING_ELT(tmpl, 0));
+    const char* system_c = Rf_isNull(system_prompt) ? nullptr : CHAR(STRING_ELT(system_prompt, 0));
+    newrllama_chat_handle handle = nullptr;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.chat_create(ctx, as<int32_t>(seq_id), tmpl_c, system_c, &handle, &error_message), error_message);
+
+    // The context is kept as the pointer's protected value so it outlives the session.
+    SEXP p = PROTECT(R_MakeExternalPtr(handle, R_NilValue, ctx_ptr));
+    Rf_setAttrib(p, R_ClassSymbol, Rf_mkString("newrllama_chat"));
+    R_RegisterCFinalizerEx(p, (R_CFinalizer_t)chat_finalizer, TRUE);
+    UNPROTECT(1);
+    return p;
+}
+
+// Without a callback the turn runs as a job, so Ctrl-C can stop it; with one it streams on the
+// R thread like r_generate_stream.
+SEXP r_chat_send(SEXP chat_ptr, SEXP message, SEXP max_tokens, SEXP top_k, SEXP top_p, SEXP temperature, SEXP repeat_last_n, SEXP penalty_repeat, SEXP seed, SEXP grammar, SEXP stop_strings, SEXP callback, SEXP return_stats) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_chat_handle chat = static_cast<newrllama_chat_handle>(R_ExternalPtrAddr(chat_ptr));
+    const char* message_c = CHAR(STRING_ELT(message, 0));
+    const std::vector<const char*> stop_c = stop_from_sexp(stop_strings);
+    struct newrllama_sampling_params params = sampling_params(as<int>(max_tokens), as<int>(top_k), as<float>(top_p), as<float>(temperature), as<int>(repeat_last_n), as<float>(penalty_repeat), as<int32_t>(seed), grammar_from_sexp(grammar), 0, &stop_c);
+    bool return_stats_bool = as<bool>(return_stats);
+    const char* error_message = nullptr;
+    if (Rf_isNull(callback)) {
+        newrllama_job_handle job = nullptr;
+        check_error(newrllama_api.chat_send_async(chat, message_c, &params, &job, &error_message), error_message);
+        return run_job(job, return_stats_bool);
+    }
+    stream_callback_data data = {callback, false, std::string()};
+    struct newrllama_perf_stats stats = {};
+    char* result_c = nullptr;
+    check_error(newrllama_api.chat_send(chat, message_c, &params, stream_callback, &data, &result_c, &stats, &error_message), error_message);
+    CharacterVector result = CharacterVector::create(std::string(result_c));
+    newrllama_api.free_string(result_c);
+    if (data.failed) {
+        stop(data.error);
+    }
+    if (return_stats_bool) {
+        result.attr("stats") = perf_stats_to_list(stats, 0.0);
+    }
+    return result;
+}
+
+SEXP r_chat_history(SEXP chat_ptr) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_chat_handle chat = static_cast<newrllama_chat_handle>(R_ExternalPtrAddr(chat_ptr));
+    char** roles_c = nullptr;
+    char** contents_c = nullptr;
+    int n = 0;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.chat_messages(chat, &roles_c, &contents_c, &n, &error_message), error_message);
+    SEXP role = PROTECT(Rf_allocVector(STRSXP, n));
+    SEXP content = PROTECT(Rf_allocVector(STRSXP, n));
+    for (int i = 0; i < n; ++i) {
+        SET_STRING_ELT(role, i, Rf_mkCharCE(roles_c[i], CE_UTF8));
+        SET_STRING_ELT(content, i, Rf_mkCharCE(contents_c[i], CE_UTF8));
+    }
+    newrllama_api.free_string_array(roles_c, n);
+    newrllama_api.free_string_array(contents_c, n);
+    List df = List::create(Named("role") = role, Named("content") = content);
+    df.attr("class") = "data.frame";
+    df.attr("row.names") = IntegerVector::create(NA_INTEGER, -n);
+    UNPROTECT(2);
+    return df;
+}
+
+SEXP r_chat_info(SEXP chat_ptr) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_chat_handle chat = static_cast<newrllama_chat_handle>(R_ExternalPtrAddr(chat_ptr));
+    int n_messages = 0;
+    int n_tokens = 0;
+    newrllama_api.chat_info(chat, &n_messages, &n_tokens);
+    return List::create(Named("n_messages") = n_messages, Named("n_tokens") = n_tokens);
+}
+
+SEXP r_chat_reset(SEXP chat_ptr) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_api.chat_reset(static_cast<newrllama_chat_handle>(R_ExternalPtrAddr(chat_ptr)));
+    return R_NilValue;
+}
+
+SEXP r_embed(SEXP ctx_ptr, SEXP tokens, SEXP normalize) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    IntegerVector tokens_vec = as<IntegerVector>(tokens);
+    bool normalize_bool = as<bool>(normalize);
+    float* embd_c = nullptr;
+    int n_embd = 0;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.embed(ctx, INTEGER(tokens_vec), tokens_vec.size(), normalize_bool, &embd_c, &n_embd, &error_message), error_message);
+    NumericVector result(n_embd);
+    std::copy(embd_c, embd_c + n_embd, REAL(result));
+    newrllama_api.free_embeddings(embd_c);
+    return result;
+}
+
+SEXP r_embed_batch(SEXP ctx_ptr, SEXP texts, SEXP normalize) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    CharacterVector texts_vec = as<CharacterVector>(texts);
+    bool normalize_bool = as<bool>(normalize);
+    std::vector<const char*> texts_c(texts_vec.size());
+    for (int i = 0; i < texts_vec.size(); ++i) {
+        texts_c[i] = CHAR(STRING_ELT(texts_vec, i));
+    }
+    float* embd_c = nullptr;
+    int n_embd = 0;
+    const char* error_message = nullptr;
+    check_error(newrllama_api.embed_batch(ctx, texts_c.data(), texts_c.size(), normalize_bool, &embd_c, &n_embd, &error_message), error_message);
+    // The backend returns one row per text; R matrices are column-major, so transpose
+    // while converting to double in a single pass.
+    const size_t n_texts = texts_c.size();
+    SEXP result = PROTECT(Rf_allocMatrix(REALSXP, (int)n_texts, n_embd));
+    double* out = REAL(result);
+    for (size_t i = 0; i < n_texts; ++i) {
+        const float* row = embd_c + i * n_embd;
+        for (int d = 0; d < n_embd; ++d) {
+            out[i + (size_t)d * n_texts] = row[d];
+        }
+    }
+    newrllama_api.free_embeddings(embd_c);
+    UNPROTECT(1);
+    return result;
+}
+
+SEXP r_state_save(SEXP ctx_ptr, SEXP path) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    std::string path_str = as<std::string>(path);
+    const char* error_message = nullptr;
+    check_error(newrllama_api.state_save(ctx, path_str.c_str(), &error_message), error_message);
+    return R_NilValue;
+}
+
+SEXP r_state_load(SEXP ctx_ptr, SEXP path) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    std::string path_str = as<std::string>(path);
+    const char* error_message = nullptr;
+    check_error(newrllama_api.state_load(ctx, path_str.c_str(), &error_message), error_message);
+    return R_NilValue;
+}
+
+SEXP r_state_seq_save(SEXP ctx_ptr, SEXP path, SEXP seq_id) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    std::string path_str = as<std::string>(path);
+    int32_t seq_id_int = as<int32_t>(seq_id);
+    const char* error_message = nullptr;
+    check_error(newrllama_api.state_seq_save(ctx, path_str.c_str(), seq_id_int, &error_message), error_message);
+    return R_NilValue;
+}
+
+SEXP r_state_seq_load(SEXP ctx_ptr, SEXP path, SEXP seq_id) {
+    if (!newrllama_api_is_loaded()) {
+        stop("Backend library is not loaded. Please run install_newrllama() first.");
+    }
+    newrllama_context_handle ctx = static_cast<newrllama_context_handle>(R_ExternalPtrAddr(ctx_ptr));
+    std::string path_str = as<std::string>(path);
+    int32_t seq_id_int = as<int32_t>(seq_id);
+    const char* error_message = nullptr;
+    check_error(newrllama_api.state_seq_load(ctx, path_str.c_str(), seq_id_int, &error_message), error_message);
+    return R_NilValue;
 }
 
 SEXP r_token_get_text(SEXP model_ptr, SEXP token_sexp) {
@@ -351,6 +1354,19 @@ SEXP r_token_is_control(SEXP model_ptr, SEXP token_sexp) {
     return LogicalVector::create(newrllama_api.token_is_control(model, token));
 }
 
+// Peak resident set size of the R process in MB, used by benchmark().
+SEXP r_peak_rss_mb() {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return NumericVector::create(NA_REAL);
+    }
+#ifdef __APPLE__
+    return NumericVector::create(usage.ru_maxrss / (1024.0 * 1024.0));
+#else
+    return NumericVector::create(usage.ru_maxrss / 1024.0);
+#endif
+}
+
 void r_newrllama_api_reset() {
     newrllama_api_reset();
 }
@@ -391,4 +1407,75 @@ SEXP r_tokenize_test(SEXP model_ptr) {
     return tokens_r;
 }
 
-} 
\ No newline at end of file
+// --- Model-free backend helpers (newrllama_utils.h), exposed for the package tests ---
+// They run without the backend library, so they need no loaded model.
+
+static SEXP size_or_na(size_t n) {
+    return Rf_ScalarReal(n == std::string::npos ? NA_REAL : (double)n);
+}
+
+SEXP r_test_parallel_slot_count(SEXP n_seq_max, SEXP n_prompts, SEXP n_batch) {
+    return Rf_ScalarInteger(parallel_slot_count(as<int>(n_seq_max), as<int>(n_prompts), as<int>(n_batch)));
+}
+
+SEXP r_test_context_shift_size(SEXP n_cached, SEXP n_add, SEXP n_ctx_seq, SEXP n_keep) {
+    return size_or_na(context_shift_size((size_t)as<double>(n_cached), (size_t)as<double>(n_add), (size_t)as<double>(n_ctx_seq), (size_t)as<double>(n_keep)));
+}
+
+// Feeds `pieces` one at a time, as the decode loop does, until a stop string matches.
+SEXP r_test_stop_matcher(SEXP pieces, SEXP stop_strings) {
+    const std::vector<const char*> stop_c = stop_from_sexp(stop_strings);
+    const stop_matcher stop(stop_c.data(), (int)stop_c.size());
+    CharacterVector pieces_vec = as<CharacterVector>(pieces);
+    std::string text;
+    std::vector<double> ready;
+    double stop_pos = NA_REAL;
+    for (R_xlen_t i = 0; i < pieces_vec.size(); ++i) {
+        const size_t n_old = text.size();
+        text += as<std::string>(pieces_vec[i]);
+        const size_t pos = stop.find(text, n_old);
+        if (pos != std::string::npos) {
+            stop_pos = (double)pos;
+            break;
+        }
+        ready.push_back((double)stop.ready_length(text));
+    }
+    return List::create(Named("stop") = stop_pos, Named("ready") = wrap(ready));
+}
+
+SEXP r_test_lookup_draft(SEXP history, SEXP ngram_max, SEXP n_want) {
+    IntegerVector history_vec = as<IntegerVector>(history);
+    std::vector<int32_t> drafts;
+    lookup_draft(std::vector<int32_t>(history_vec.begin(), history_vec.end()), as<int>(ngram_max), as<int>(n_want), drafts);
+    return wrap(drafts);
+}
+
+SEXP r_test_offsets_valid(SEXP offsets, SEXP n_tokens) {
+    NumericVector offsets_vec = as<NumericVector>(offsets);
+    return Rf_ScalarLogical(offsets_vec.size() >= 1 && offsets_valid(REAL(offsets_vec), offsets_vec.size() - 1, as<double>(n_tokens)));
+}
+
+SEXP r_test_trace_sequence(SEXP n_tokens_in, SEXP n_prefilled, SEXP n_keep, SEXP n_discarded, SEXP n_cached) {
+    const sequence_trace trace = trace_sequence((size_t)as<double>(n_tokens_in), (size_t)as<double>(n_prefilled), (size_t)as<double>(n_keep), (size_t)as<double>(n_discarded), (size_t)as<double>(n_cached));
+    return List::create(Named("prefilled") = trace.prefilled, Named("n_generated") = (double)trace.n_generated, Named("n_dropped") = (double)trace.n_dropped);
+}
+
+// `pieces[token + 1]` stands in for the text of token id `token`.
+SEXP r_test_chat_kept_tokens(SEXP cached, SEXP trace, SEXP reply, SEXP pieces) {
+    IntegerVector cached_vec = as<IntegerVector>(cached);
+    List trace_list = as<List>(trace);
+    sequence_trace trace_c;
+    trace_c.prefilled = as<bool>(trace_list["prefilled"]);
+    trace_c.n_generated = (size_t)as<double>(trace_list["n_generated"]);
+    trace_c.n_dropped = (size_t)as<double>(trace_list["n_dropped"]);
+    CharacterVector pieces_vec = as<CharacterVector>(pieces);
+    auto piece = [&pieces_vec](int32_t token, std::string& out) {
+        if (token < 0 || token >= pieces_vec.size()) stop("No piece for token %d.", token);
+        out += as<std::string>(pieces_vec[token]);
+    };
+    size_t n_covered = 0;
+    const size_t n_kept = chat_kept_tokens(std::vector<int32_t>(cached_vec.begin(), cached_vec.end()), trace_c, as<std::string>(reply), piece, &n_covered);
+    return List::create(Named("n_kept") = size_or_na(n_kept), Named("n_covered") = (double)n_covered);
+}
+
+}
@@ -0,0 +1,150 @@
+#ifndef NEWRLLAMA_UTILS_H
+#define NEWRLLAMA_UTILS_H
+
+// Model-free pieces of the backend: text and token bookkeeping that needs no llama.cpp calls.
+// Header-only, so the R package compiles the same code for its tests; tokens are plain int32_t
+// (llama_token).
+#include "newrllama_capi.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Continuous batching: the sequence slots a parallel run schedules its prompts over. Every
+// generating slot adds at least one token per step, so more slots than n_batch could not share a
+// batch, and at least one slot is kept so an empty run still has a valid pool.
+inline int parallel_slot_count(int n_seq_max, int n_prompts, int n_batch) {
+    return std::max(1, std::min({n_seq_max, n_prompts, n_batch}));
+}
+
+// Context shift: how many positions of a sequence holding n_cached tokens to discard, after its
+// first n_keep, so that n_add more fit in its n_ctx_seq cells. At least half of what follows
+// n_keep goes, so a long generation shifts rarely. 0 when there is room already, npos when n_keep
+// leaves too little to discard.
+inline size_t context_shift_size(size_t n_cached, size_t n_add, size_t n_ctx_seq, size_t n_keep) {
+    if (n_cached + n_add <= n_ctx_seq) return 0;
+    n_keep = std::min(n_keep, n_cached);
+    const size_t n_discard = std::max(n_cached + n_add - n_ctx_seq, (n_cached - n_keep) / 2);
+    return n_discard <= n_cached - n_keep ? n_discard : std::string::npos;
+}
+
+// Length of the longest prefix of `s` that does not end inside a UTF-8 multi-byte sequence.
+inline size_t utf8_complete_length(const std::string& s) {
+    size_t n = s.size();
+    size_t i = n;
+    while (i > 0 && n - i < 4) {
+        const unsigned char c = (unsigned char)s[i - 1];
+        if ((c & 0xC0) != 0x80) {
+            size_t need = (c & 0x80) == 0 ? 1 : (c & 0xE0) == 0xC0 ? 2 : (c & 0xF0) == 0xE0 ? 3 : (c & 0xF8) == 0xF0 ? 4 : 1;
+            return (n - (i - 1) >= need) ? n : i - 1;
+        }
+        i--;
+    }
+    return n;
+}
+
+// Stop strings of one sequence, matched as its text grows one token piece at a time. A stop may
+// span several pieces, so each check rescans only the tail that could still hold its start: the
+// new piece plus the longest stop's length minus one before it.
+struct stop_matcher {
+    std::vector<std::string> stops;
+    size_t max_len = 0;
+    stop_matcher() = default;
+    stop_matcher(const char* const* stop, int n_stop) {
+        for (int i = 0; stop && i < n_stop; ++i) {
+            if (!stop[i] || !*stop[i]) continue;
+            stops.emplace_back(stop[i]);
+            max_len = std::max(max_len, stops.back().size());
+        }
+    }
+    explicit stop_matcher(const newrllama_sampling_params& params) : stop_matcher(params.stop, params.n_stop) {}
+    // Position of the earliest stop string in `text`, whose bytes before n_old were checked
+    // already, or npos.
+    size_t find(const std::string& text, size_t n_old) const {
+        if (stops.empty()) return std::string::npos;
+        const size_t from = n_old >= max_len ? n_old - max_len + 1 : 0;
+        size_t first = std::string::npos;
+        for (const auto& s : stops) first = std::min(first, text.find(s, from));
+        return first;
+    }
+    // Length of `text` that can be streamed: complete UTF-8, and short of any tail that might be
+    // the start of a stop string still being generated.
+    size_t ready_length(const std::string& text) const {
+        size_t n_held = 0;
+        for (size_t k = std::min(max_len > 0 ? max_len - 1 : 0, text.size()); k > 0 && n_held == 0; --k) {
+            for (const auto& s : stops) {
+                if (s.compare(0, k, text, text.size() - k, k) == 0) {
+                    n_held = k;
+                    break;
+                }
+            }
+        }
+        return std::min(utf8_complete_length(text), text.size() - n_held);
+    }
+};
+
+// Prompt-lookup drafting: finds the latest earlier occurrence of the last n tokens of `history`
+// (n from ngram_max down to 1) and proposes up to n_want of the tokens that followed it. Output
+// that copies spans of the prompt or of itself is guessed this way without a draft model.
+inline void lookup_draft(const std::vector<int32_t>& history, int ngram_max, int n_want, std::vector<int32_t>& drafts) {
+    const size_t n_hist = history.size();
+    for (size_t n = std::min<size_t>(ngram_max, n_hist > 0 ? n_hist - 1 : 0); n >= 1; --n) {
+        const int32_t* key = history.data() + n_hist - n;
+        for (size_t i = n_hist - n; i-- > 0; ) {
+            if (!std::equal(key, key + n, history.data() + i)) continue;
+            const size_t n_take = std::min<size_t>(n_want, n_hist - (i + n));
+            drafts.assign(history.begin() + i + n, history.begin() + i + n + n_take);
+            return;
+        }
+    }
+}
+
+// CSR offsets of n_seqs token runs (n_seqs + 1 entries): non-negative, non-decreasing and
+// ending at most at n_tokens.
+template <typename T>
+inline bool offsets_valid(const T* offsets, size_t n_seqs, T n_tokens) {
+    if (!(offsets[0] >= 0) || !(offsets[n_seqs] <= n_tokens)) return false;
+    for (size_t i = 0; i < n_seqs; ++i) {
+        if (!(offsets[i + 1] >= offsets[i])) return false;
+    }
+    return true;
+}
+
+// Where a generation left its sequence, for callers that keep building on it (chat_turn).
+struct sequence_trace {
+    bool prefilled = false;   // the whole prompt was decoded (false if cancelled before)
+    size_t n_generated = 0;   // generated tokens ending the sequence's cache
+    size_t n_dropped = 0;     // generated tokens context shifts discarded ahead of those
+};
+
+// Context shifts always discard the oldest positions after n_keep, so n_discarded positions in
+// total came off the prompt's shiftable part first and off the generated tokens after that.
+inline sequence_trace trace_sequence(size_t n_tokens_in, size_t n_prefilled, size_t n_keep, size_t n_discarded, size_t n_cached) {
+    sequence_trace trace;
+    trace.prefilled = n_prefilled == n_tokens_in;
+    const size_t n_prompt_dropped = std::min(n_discarded, n_prefilled - std::min(n_keep, n_prefilled));
+    trace.n_dropped = n_discarded - n_prompt_dropped;
+    trace.n_generated = n_cached - (n_prefilled - n_prompt_dropped);
+    return trace;
+}
+
+// How many leading tokens of `cached`, a chat sequence's mirror after a turn, the conversation
+// keeps: all of them when the generated ones spell a prefix of `reply`, else those before the
+// generated ones (a stop string can leave tokens past the reply's end). *n_covered receives the
+// bytes of `reply` the kept tokens spell; the caller tokenizes the rest. npos when the turn
+// was cancelled mid-prompt or its reply alone outgrew the sequence, so the next turn starts
+// over. `piece(token, text)` appends a token's text.
+template <typename Piece>
+inline size_t chat_kept_tokens(const std::vector<int32_t>& cached, const sequence_trace& trace, const std::string& reply, Piece piece, size_t* n_covered) {
+    *n_covered = 0;
+    if (!trace.prefilled || trace.n_dropped > 0 || trace.n_generated > cached.size()) return std::string::npos;
+    const size_t n_prompt = cached.size() - trace.n_generated;
+    std::string cached_reply;
+    for (size_t i = n_prompt; i < cached.size(); ++i) piece(cached[i], cached_reply);
+    if (reply.compare(0, cached_reply.size(), cached_reply) != 0) return n_prompt;
+    *n_covered = cached_reply.size();
+    return cached.size();
+}
+
+#endif // NEWRLLAMA_UTILS_H
@@ -26,20 +26,80 @@ bool newrllama_api_init(void* handle) {
         // 加载核心函数
         LOAD_SYMBOL(handle, backend_init);
         LOAD_SYMBOL(handle, backend_free);
+        LOAD_SYMBOL(handle, cpu_info);
         LOAD_SYMBOL(handle, model_load);
         LOAD_SYMBOL(handle, model_free);
+        LOAD_SYMBOL(handle, model_cache_set_policy);
+        LOAD_SYMBOL(handle, model_cache_clear);
+        LOAD_SYMBOL(handle, model_cache_info);
         LOAD_SYMBOL(handle, context_create);
+        LOAD_SYMBOL(handle, context_default_params);
+        LOAD_SYMBOL(handle, context_create_ext);
         LOAD_SYMBOL(handle, context_free);
+        LOAD_SYMBOL(handle, kv_cache_clear);
         
         // 加载文本处理函数
         LOAD_SYMBOL(handle, tokenize);
+        LOAD_SYMBOL(handle, tokenize_into);
+        LOAD_SYMBOL(handle, tokenize_batch);
         LOAD_SYMBOL(handle, detokenize);
+        LOAD_SYMBOL(handle, detokenize_into);
+        LOAD_SYMBOL(handle, detokenize_batch);
         LOAD_SYMBOL(handle, apply_chat_template);
         LOAD_SYMBOL(handle, generate);
+        LOAD_SYMBOL(handle, generate_stream);
         LOAD_SYMBOL(handle, generate_parallel);
+        LOAD_SYMBOL(handle, sampling_default_params);
+        LOAD_SYMBOL(handle, generate_ext);
+        LOAD_SYMBOL(handle, json_schema_to_grammar);
+        
+        // 加载生成任务函数
+        LOAD_SYMBOL(handle, generate_async);
+        LOAD_SYMBOL(handle, generate_ext_async);
+        LOAD_SYMBOL(handle, generate_parallel_async);
+        LOAD_SYMBOL(handle, generate_parallel_ext_async);
+        LOAD_SYMBOL(handle, generate_speculative_async);
+        LOAD_SYMBOL(handle, job_status);
+        LOAD_SYMBOL(handle, job_wait);
+        LOAD_SYMBOL(handle, job_cancel);
+        LOAD_SYMBOL(handle, job_result);
+        LOAD_SYMBOL(handle, job_result_arena);
+        LOAD_SYMBOL(handle, job_free);
+        LOAD_SYMBOL(handle, job_token_probs);
+        LOAD_SYMBOL(handle, free_token_probs);
+        LOAD_SYMBOL(handle, score_async);
+        LOAD_SYMBOL(handle, job_scores);
+        LOAD_SYMBOL(handle, free_scores);
+        
+        // 加载上下文池函数
+        LOAD_SYMBOL(handle, pool_create);
+        LOAD_SYMBOL(handle, pool_free);
+        LOAD_SYMBOL(handle, pool_generate_async);
+        LOAD_SYMBOL(handle, pool_info);
+        
+        // 加载聊天会话函数
+        LOAD_SYMBOL(handle, chat_create);
+        LOAD_SYMBOL(handle, chat_send);
+        LOAD_SYMBOL(handle, chat_send_async);
+        LOAD_SYMBOL(handle, chat_messages);
+        LOAD_SYMBOL(handle, chat_info);
+        LOAD_SYMBOL(handle, chat_reset);
+        LOAD_SYMBOL(handle, chat_free);
+        
+        // 加载嵌入函数
+        LOAD_SYMBOL(handle, embed);
+        LOAD_SYMBOL(handle, embed_batch);
+        LOAD_SYMBOL(handle, free_embeddings);
+        
+        // 加载状态快照函数
+        LOAD_SYMBOL(handle, state_save);
+        LOAD_SYMBOL(handle, state_load);
+        LOAD_SYMBOL(handle, state_seq_save);
+        LOAD_SYMBOL(handle, state_seq_load);
         
         // 加载内存管理函数
         LOAD_SYMBOL(handle, free_tokens);
+        LOAD_SYMBOL(handle, free_offsets);
         LOAD_SYMBOL(handle, free_string);
         LOAD_SYMBOL(handle, free_string_array);
         
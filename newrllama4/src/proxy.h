@@ -7,20 +7,80 @@ struct newrllama_api_ptrs {
     // Core functions
     decltype(&newrllama_backend_init) backend_init;
     decltype(&newrllama_backend_free) backend_free;
+    decltype(&newrllama_cpu_info) cpu_info;
     decltype(&newrllama_model_load) model_load;
     decltype(&newrllama_model_free) model_free;
+    decltype(&newrllama_model_cache_set_policy) model_cache_set_policy;
+    decltype(&newrllama_model_cache_clear) model_cache_clear;
+    decltype(&newrllama_model_cache_info) model_cache_info;
     decltype(&newrllama_context_create) context_create;
+    decltype(&newrllama_context_default_params) context_default_params;
+    decltype(&newrllama_context_create_ext) context_create_ext;
     decltype(&newrllama_context_free) context_free;
+    decltype(&newrllama_kv_cache_clear) kv_cache_clear;
     
     // Text processing functions
     decltype(&newrllama_tokenize) tokenize;
+    decltype(&newrllama_tokenize_into) tokenize_into;
+    decltype(&newrllama_tokenize_batch) tokenize_batch;
     decltype(&newrllama_detokenize) detokenize;
+    decltype(&newrllama_detokenize_into) detokenize_into;
+    decltype(&newrllama_detokenize_batch) detokenize_batch;
     decltype(&newrllama_apply_chat_template) apply_chat_template;
     decltype(&newrllama_generate) generate;
+    decltype(&newrllama_generate_stream) generate_stream;
     decltype(&newrllama_generate_parallel) generate_parallel;
+    decltype(&newrllama_sampling_default_params) sampling_default_params;
+    decltype(&newrllama_generate_ext) generate_ext;
+    decltype(&newrllama_json_schema_to_grammar) json_schema_to_grammar;
+    
+    // Generation job functions
+    decltype(&newrllama_generate_async) generate_async;
+    decltype(&newrllama_generate_ext_async) generate_ext_async;
+    decltype(&newrllama_generate_parallel_async) generate_parallel_async;
+    decltype(&newrllama_generate_parallel_ext_async) generate_parallel_ext_async;
+    decltype(&newrllama_generate_speculative_async) generate_speculative_async;
+    decltype(&newrllama_job_status) job_status;
+    decltype(&newrllama_job_wait) job_wait;
+    decltype(&newrllama_job_cancel) job_cancel;
+    decltype(&newrllama_job_result) job_result;
+    decltype(&newrllama_job_result_arena) job_result_arena;
+    decltype(&newrllama_job_free) job_free;
+    decltype(&newrllama_job_token_probs) job_token_probs;
+    decltype(&newrllama_free_token_probs) free_token_probs;
+    decltype(&newrllama_score_async) score_async;
+    decltype(&newrllama_job_scores) job_scores;
+    decltype(&newrllama_free_scores) free_scores;
+    
+    // Context pool functions
+    decltype(&newrllama_pool_create) pool_create;
+    decltype(&newrllama_pool_free) pool_free;
+    decltype(&newrllama_pool_generate_async) pool_generate_async;
+    decltype(&newrllama_pool_info) pool_info;
+    
+    // Chat session functions
+    decltype(&newrllama_chat_create) chat_create;
+    decltype(&newrllama_chat_send) chat_send;
+    decltype(&newrllama_chat_send_async) chat_send_async;
+    decltype(&newrllama_chat_messages) chat_messages;
+    decltype(&newrllama_chat_info) chat_info;
+    decltype(&newrllama_chat_reset) chat_reset;
+    decltype(&newrllama_chat_free) chat_free;
+    
+    // Embedding functions
+    decltype(&newrllama_embed) embed;
+    decltype(&newrllama_embed_batch) embed_batch;
+    decltype(&newrllama_free_embeddings) free_embeddings;
+    
+    // State snapshot functions
+    decltype(&newrllama_state_save) state_save;
+    decltype(&newrllama_state_load) state_load;
+    decltype(&newrllama_state_seq_save) state_seq_save;
+    decltype(&newrllama_state_seq_load) state_seq_load;
     
     // Memory management functions
     decltype(&newrllama_free_tokens) free_tokens;
+    decltype(&newrllama_free_offsets) free_offsets;
     decltype(&newrllama_free_string) free_string;
     decltype(&newrllama_free_string_array) free_string_array;
     